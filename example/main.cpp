@@ -59,7 +59,7 @@ int main(int argc, char* argv[]) {
         P = (cl_uint)i;
         kernel.rebuild(false); // P has changed
 
-        err = state.cmdQueue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(N));
+        err = kernel.enqueue(state.cmdQueue, cl::NDRange(N));
         clt::check(err, "Failed to enqueue kernel");
 
         err = state.cmdQueue.finish();
@@ -72,5 +72,7 @@ int main(int argc, char* argv[]) {
             std::cout << (i + 1) << "^" << P << " = " << indata[i] << std::endl;
     }
 
+    clt::printKernelStats();
+
     return 0;
 }
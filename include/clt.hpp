@@ -4,5 +4,11 @@
 #include "cl_header.hpp"
 #include "../src/utils.hpp"
 #include "../src/Kernel.hpp"
+#include "../src/Dispatcher.hpp"
+#include "../src/LaunchSequence.hpp"
+#include "../src/Scheduler.hpp"
+#include "../src/BufferPool.hpp"
+#include "../src/HostBuffer.hpp"
+#include "../src/DeviceVector.hpp"
 
 #endif
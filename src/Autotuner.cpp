@@ -0,0 +1,134 @@
+#include "Autotuner.hpp"
+#include "utils.hpp"
+#include <sstream>
+#include <algorithm>
+
+namespace clt {
+
+cl::NDRange makeNDRange(const size_t* sizes, size_t dims)
+{
+    switch (dims)
+    {
+        case 1: return cl::NDRange(sizes[0]);
+        case 2: return cl::NDRange(sizes[0], sizes[1]);
+        case 3: return cl::NDRange(sizes[0], sizes[1], sizes[2]);
+        default: return cl::NullRange;
+    }
+}
+
+// Powers of two per dimension, the last dimension is kept shallow
+std::vector<cl::NDRange> localSizeCandidates(const cl::NDRange& global, size_t maxGroupSize,
+    size_t preferredMultiple, const std::vector<size_t>& maxItemSizes)
+{
+    std::vector<cl::NDRange> candidates = { cl::NullRange };
+
+    const size_t dims = global.dimensions();
+    const size_t* globalSizes = global;
+    if (dims == 0 || maxGroupSize == 0)
+        return candidates;
+
+    preferredMultiple = std::max<size_t>(preferredMultiple, 1);
+    const size_t limits[3] = { maxGroupSize, maxGroupSize, (dims == 3) ? std::min<size_t>(maxGroupSize, 4) : 1 };
+
+    size_t size[3] = { 1, 1, 1 };
+    for (size[0] = 1; size[0] <= limits[0]; size[0] *= 2)
+    {
+        for (size[1] = 1; size[1] <= ((dims > 1) ? limits[1] : 1); size[1] *= 2)
+        {
+            for (size[2] = 1; size[2] <= ((dims > 2) ? limits[2] : 1); size[2] *= 2)
+            {
+                const size_t total = size[0] * size[1] * size[2];
+                if (total > maxGroupSize || total % preferredMultiple != 0)
+                    continue;
+
+                bool valid = true;
+                for (size_t d = 0; d < dims; d++)
+                {
+                    const size_t itemLimit = (d < maxItemSizes.size()) ? maxItemSizes[d] : maxGroupSize;
+                    valid &= (size[d] <= itemLimit && globalSizes[d] % size[d] == 0);
+                }
+
+                if (valid)
+                    candidates.push_back(makeNDRange(size, dims));
+            }
+        }
+    }
+
+    return candidates;
+}
+
+double timeLaunches(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::NDRange& global,
+    const cl::NDRange& local, int repeats)
+{
+    cl_int err = CL_SUCCESS;
+    std::vector<cl::Event> events(std::max(repeats, 1) + 1);
+    for (size_t i = 0; i < events.size() && err == CL_SUCCESS; i++)
+        CLT_CALL(err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, &events[i]), err);
+
+    if (err != CL_SUCCESS)
+        return -1.0;
+
+    CLT_CALL(err = queue.finish(), err);
+    if (err != CL_SUCCESS)
+        return -1.0;
+
+    // First launch warms up caches and lazy driver state
+    double total = 0.0;
+    for (size_t i = 1; i < events.size(); i++)
+    {
+        cl_ulong start = 0, end = 0;
+        CLT_CALL(err = events[i].getProfilingInfo(CL_PROFILING_COMMAND_START, &start), err);
+        check(err, "Autotuning needs a queue with profiling enabled");
+        CLT_CALL(err = events[i].getProfilingInfo(CL_PROFILING_COMMAND_END, &end), err);
+        check(err, "Autotuning needs a queue with profiling enabled");
+        total += (end - start) * 1e-6;
+    }
+
+    return total / (events.size() - 1);
+}
+
+bool localSizeFits(const cl::NDRange& global, const cl::NDRange& local)
+{
+    if (local.dimensions() == 0 || local.dimensions() != global.dimensions())
+        return false;
+
+    const size_t* g = global;
+    const size_t* l = local;
+    for (size_t d = 0; d < global.dimensions(); d++)
+    {
+        if (l[d] == 0 || g[d] % l[d] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+std::string formatNDRange(const cl::NDRange& range)
+{
+    std::ostringstream out;
+    out << range.dimensions();
+    const size_t* sizes = range;
+    for (size_t d = 0; d < range.dimensions(); d++)
+        out << " " << sizes[d];
+    return out.str();
+}
+
+bool parseNDRange(const std::string& str, cl::NDRange& range)
+{
+    std::istringstream in(str);
+    size_t dims = 0;
+    size_t sizes[3] = { 0, 0, 0 };
+    if (!(in >> dims) || dims > 3)
+        return false;
+
+    for (size_t d = 0; d < dims; d++)
+    {
+        if (!(in >> sizes[d]) || sizes[d] == 0)
+            return false;
+    }
+
+    range = makeNDRange(sizes, dims);
+    return true;
+}
+
+} // end namespace clt
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../include/cl_header.hpp"
+
+namespace clt {
+
+// Local sizes worth measuring for a global size: products that are multiples of
+// the preferred multiple, up to the kernel's maximum work-group size, that divide
+// the global size in every dimension. The driver's choice (NullRange) comes first.
+std::vector<cl::NDRange> localSizeCandidates(const cl::NDRange& global, size_t maxGroupSize,
+    size_t preferredMultiple, const std::vector<size_t>& maxItemSizes);
+
+// Mean device time (ms) of a launch measured with profiling events after one warm-up
+// launch, negative if the configuration cannot be launched. Blocks until done.
+double timeLaunches(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::NDRange& global,
+    const cl::NDRange& local, int repeats);
+
+// Local size fits a launch: same dimensions, divides the global size
+bool localSizeFits(const cl::NDRange& global, const cl::NDRange& local);
+
+// Range of 1-3 dimensions, NullRange otherwise
+cl::NDRange makeNDRange(const size_t* sizes, size_t dims);
+
+std::string formatNDRange(const cl::NDRange& range);
+bool parseNDRange(const std::string& str, cl::NDRange& range);
+
+} // end namespace clt
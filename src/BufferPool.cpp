@@ -0,0 +1,255 @@
+#include "BufferPool.hpp"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+namespace clt {
+
+BufferPool::BufferPool(State& state, size_t arenaSize) : m_context(state.context)
+{
+    // Sub-buffer offsets must suit every device of the context
+    std::vector<cl::Device> devices = state.devices.empty() ? std::vector<cl::Device>{ state.device } : state.devices;
+    cl_ulong maxAlloc = (cl_ulong)-1;
+    for (cl::Device &device : devices)
+    {
+        const size_t align = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8; // bits
+        m_alignment = std::max(m_alignment, align);
+        maxAlloc = std::min(maxAlloc, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+    }
+
+    m_arenaSize = (size_t)std::min<cl_ulong>(arenaSize, maxAlloc);
+    m_arenaSize -= m_arenaSize % m_alignment;
+}
+
+// Four classes per power of two, at most 25% rounding waste
+size_t BufferPool::sizeClass(size_t size) const
+{
+    const size_t minSize = std::max<size_t>(256, m_alignment);
+    size_t rounded = minSize;
+    if (size > minSize)
+    {
+        size_t pow2 = minSize;
+        while (pow2 * 2 < size)
+            pow2 *= 2;
+
+        const size_t step = std::max<size_t>(pow2 / 4, 1);
+        rounded = pow2 + ((size - pow2 + step - 1) / step) * step;
+    }
+
+    return ((rounded + m_alignment - 1) / m_alignment) * m_alignment;
+}
+
+// First fit, sizes are multiples of the alignment so offsets stay aligned
+bool BufferPool::allocateRange(size_t size, size_t& arena, size_t& offset)
+{
+    for (auto &it : m_arenas)
+    {
+        std::map<size_t, size_t> &ranges = it.second.freeRanges;
+        for (auto r = ranges.begin(); r != ranges.end(); ++r)
+        {
+            if (r->second < size)
+                continue;
+
+            arena = it.first;
+            offset = r->first;
+            const size_t remaining = r->second - size;
+            ranges.erase(r);
+            if (remaining > 0)
+                ranges[offset + size] = remaining;
+
+            it.second.used += size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Coalesces with neighbouring free ranges
+void BufferPool::freeRange(size_t arena, size_t offset, size_t size)
+{
+    Arena &a = m_arenas[arena];
+    a.used -= size;
+
+    auto next = a.freeRanges.lower_bound(offset);
+    if (next != a.freeRanges.end() && offset + size == next->first)
+    {
+        size += next->second;
+        next = a.freeRanges.erase(next);
+    }
+
+    if (next != a.freeRanges.begin())
+    {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset)
+        {
+            prev->second += size;
+            return;
+        }
+    }
+
+    a.freeRanges[offset] = size;
+}
+
+cl::Buffer BufferPool::createBlock(Block& block, int& err)
+{
+    err = CL_SUCCESS;
+    if (block.size > m_arenaSize / 4)
+    {
+        block.arena = NO_ARENA;
+        CLT_CALL(block.buffer = cl::Buffer(m_context, block.flags, block.size, nullptr, &err), err);
+        return block.buffer;
+    }
+
+    if (!allocateRange(block.size, block.arena, block.offset))
+    {
+        Arena arena;
+        arena.size = m_arenaSize;
+        CLT_CALL(arena.buffer = cl::Buffer(m_context, CL_MEM_READ_WRITE, m_arenaSize, nullptr, &err), err);
+        if (err != CL_SUCCESS)
+            return cl::Buffer();
+
+        arena.freeRanges[0] = m_arenaSize;
+        m_arenas[m_nextArena++] = arena;
+        m_stats.bytesReserved += m_arenaSize;
+        allocateRange(block.size, block.arena, block.offset);
+    }
+
+    cl_buffer_region region = { block.offset, block.size };
+    CLT_CALL(block.buffer = m_arenas[block.arena].buffer.createSubBuffer(block.flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &err), err);
+    if (err != CL_SUCCESS)
+        freeRange(block.arena, block.offset, block.size);
+
+    return block.buffer;
+}
+
+cl::Buffer BufferPool::acquire(size_t size, cl_mem_flags flags)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Block block;
+    block.size = sizeClass(std::max<size_t>(size, 1));
+    block.requested = size;
+    block.flags = flags;
+
+    std::vector<Block> &cached = m_free[std::make_pair(block.size, flags)];
+    if (!cached.empty())
+    {
+        block.buffer = cached.back().buffer;
+        block.arena = cached.back().arena;
+        block.offset = cached.back().offset;
+        cached.pop_back();
+        m_stats.bytesCached -= block.size;
+        m_stats.hits++;
+    }
+    else
+    {
+        // Cached buffers of other classes are given back before failing
+        int err = 0;
+        createBlock(block, err);
+        if (err != CL_SUCCESS)
+        {
+            trimLocked();
+            createBlock(block, err);
+        }
+        check(err, "Failed to allocate pooled buffer");
+
+        if (block.arena == NO_ARENA)
+            m_stats.bytesReserved += block.size;
+        m_stats.misses++;
+    }
+
+    m_used[block.buffer()] = block;
+    m_stats.bytesInUse += block.size;
+    m_stats.bytesRequested += block.requested;
+    m_stats.highWaterMark = std::max(m_stats.highWaterMark, m_stats.bytesInUse);
+
+    return block.buffer;
+}
+
+void BufferPool::release(const cl::Buffer& buffer)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_used.find(buffer());
+    if (it == m_used.end())
+        throw std::runtime_error("Buffer was not acquired from this pool");
+
+    Block &block = it->second;
+    m_stats.bytesInUse -= block.size;
+    m_stats.bytesRequested -= block.requested;
+    m_stats.bytesCached += block.size;
+    m_free[std::make_pair(block.size, block.flags)].push_back(block);
+    m_used.erase(it);
+}
+
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    trimLocked();
+}
+
+void BufferPool::trimLocked()
+{
+    for (auto &it : m_free)
+    {
+        for (Block &block : it.second)
+        {
+            if (block.arena == NO_ARENA)
+                m_stats.bytesReserved -= block.size;
+            else
+                freeRange(block.arena, block.offset, block.size);
+        }
+    }
+    m_free.clear();
+    m_stats.bytesCached = 0;
+
+    // Sub-buffers still held by the application keep their arena alive in the driver
+    for (auto it = m_arenas.begin(); it != m_arenas.end(); )
+    {
+        if (it->second.used == 0)
+        {
+            m_stats.bytesReserved -= it->second.size;
+            it = m_arenas.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+BufferPoolStats BufferPool::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    BufferPoolStats stats = m_stats;
+    stats.numArenas = m_arenas.size();
+
+    size_t totalFree = 0, largestFree = 0;
+    for (const auto &it : m_arenas)
+    {
+        for (const auto &range : it.second.freeRanges)
+        {
+            totalFree += range.second;
+            largestFree = std::max(largestFree, range.second);
+        }
+    }
+    stats.fragmentation = totalFree ? 1.0 - (double)largestFree / totalFree : 0.0;
+
+    return stats;
+}
+
+void BufferPool::printStats() const
+{
+    const BufferPoolStats s = stats();
+    const double MB = 1024.0 * 1024.0;
+    std::cout << std::fixed << std::setprecision(2)
+        << "Buffer pool: " << s.bytesInUse / MB << " MB in use (" << s.bytesRequested / MB << " MB requested), "
+        << "peak " << s.highWaterMark / MB << " MB, reserved " << s.bytesReserved / MB << " MB in " << s.numArenas << " arenas, "
+        << "cached " << s.bytesCached / MB << " MB, " << s.hits << " hits / " << s.misses << " misses, "
+        << "fragmentation " << s.fragmentation * 100.0 << "%" << std::endl;
+    std::cout.unsetf(std::ios::fixed);
+}
+
+} // end namespace clt
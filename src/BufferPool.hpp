@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include "../include/cl_header.hpp"
+#include "utils.hpp"
+
+namespace clt {
+
+struct BufferPoolStats
+{
+    size_t bytesInUse = 0;      // size classes of acquired buffers
+    size_t bytesRequested = 0;  // as asked for, the difference is rounding waste
+    size_t highWaterMark = 0;   // peak of bytesInUse
+    size_t bytesReserved = 0;   // arenas and standalone buffers held by the pool
+    size_t bytesCached = 0;     // released, kept for reuse
+    size_t numArenas = 0;
+    size_t hits = 0;            // served from a free list
+    size_t misses = 0;
+    double fragmentation = 0.0; // free arena space outside the largest free range
+};
+
+// Recycles device buffers of a context. Requests are rounded up to size classes
+// (four per power of two) and released buffers are kept in per-class free lists.
+// Small buffers are sub-buffers of large arenas, placed at offsets aligned to
+// CL_DEVICE_MEM_BASE_ADDR_ALIGN; larger ones are standalone buffers.
+class BufferPool
+{
+public:
+    BufferPool(State& state, size_t arenaSize = 64 << 20);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Access flags only (CL_MEM_READ_WRITE, READ_ONLY or WRITE_ONLY).
+    // Contents are undefined, buffers are reused without clearing.
+    cl::Buffer acquire(size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+    void release(const cl::Buffer& buffer);
+
+    // Returns cached buffers and unused arenas to the driver
+    void trim();
+
+    BufferPoolStats stats() const;
+    void printStats() const;
+
+private:
+    struct Arena
+    {
+        cl::Buffer buffer;
+        size_t size = 0;
+        size_t used = 0;
+        std::map<size_t, size_t> freeRanges; // offset -> size
+    };
+
+    struct Block
+    {
+        cl::Buffer buffer;
+        size_t size = 0;      // size class
+        size_t requested = 0;
+        size_t arena = 0;     // NO_ARENA for standalone buffers
+        size_t offset = 0;
+        cl_mem_flags flags = 0;
+    };
+
+    static const size_t NO_ARENA = (size_t)-1;
+
+    size_t sizeClass(size_t size) const;
+    bool allocateRange(size_t size, size_t& arena, size_t& offset);
+    void freeRange(size_t arena, size_t offset, size_t size);
+    cl::Buffer createBlock(Block& block, int& err);
+    void trimLocked();
+
+    cl::Context m_context;
+    size_t m_alignment = 1;  // bytes
+    size_t m_arenaSize = 0;
+    size_t m_nextArena = 0;
+    std::map<size_t, Arena> m_arenas;                                   // by id
+    std::map<std::pair<size_t, cl_mem_flags>, std::vector<Block>> m_free; // by size class and flags
+    std::map<cl_mem, Block> m_used;
+    BufferPoolStats m_stats;
+    mutable std::mutex m_mutex;
+};
+
+} // end namespace clt
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <memory>
+#include "../include/cl_header.hpp"
+#include "utils.hpp"
+
+namespace clt {
+
+// Array mirrored on the host and a device. Tracks which side holds the valid copy
+// and the dirty region on the other side, and transfers only that region when
+// the stale side is accessed. Elements are laid out in rows (width x height),
+// dirty regions narrower than a row are moved with rect copies.
+// Transfers are blocking and use the queue given at construction. The host copy
+// starts value-initialized and is uploaded before the first device use.
+template <typename T>
+class DeviceVector
+{
+    friend class Kernel;
+
+public:
+    DeviceVector(State& state, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE)
+        : DeviceVector(state.context, state.cmdQueue, cl::NDRange(size), flags) {}
+
+    // Shape is (width) or (width, height)
+    DeviceVector(State& state, const cl::NDRange& shape, cl_mem_flags flags = CL_MEM_READ_WRITE)
+        : DeviceVector(state.context, state.cmdQueue, shape, flags) {}
+
+    DeviceVector(cl::Context& context, cl::CommandQueue& queue, const cl::NDRange& shape, cl_mem_flags flags = CL_MEM_READ_WRITE)
+        : m_queue(queue)
+    {
+        const size_t* sizes = shape;
+        m_width = (shape.dimensions() > 0) ? sizes[0] : 0;
+        m_height = (shape.dimensions() > 1) ? sizes[1] : 1;
+        m_host.resize(m_width * m_height);
+        m_hostDirty = Rect{ 0, 0, m_width, m_height };
+
+        int err = 0;
+        CLT_CALL(m_buffer = cl::Buffer(context, flags, std::max<size_t>(m_host.size(), 1) * sizeof(T), nullptr, &err), err);
+        check(err, "Failed to create device vector");
+    }
+
+    // Copies would share the buffer but not the dirty state
+    DeviceVector(const DeviceVector&) = delete;
+    DeviceVector& operator=(const DeviceVector&) = delete;
+
+    size_t size() const { return m_host.size(); }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+
+    // Host views of a linear range or a rectangle, pointers are to the start of the data.
+    // Writing views download device changes first and mark the region host-dirty.
+    const T* read() { return read(0, size()); }
+    const T* read(size_t begin, size_t end) { syncHost(linearRect(begin, end)); return m_host.data(); }
+    const T* readRect(size_t x, size_t y, size_t w, size_t h) { syncHost(Rect{ x, y, x + w, y + h }); return m_host.data(); }
+
+    T* write() { return write(0, size()); }
+    T* write(size_t begin, size_t end) { return writeRegion(linearRect(begin, end)); }
+    T* writeRect(size_t x, size_t y, size_t w, size_t h) { return writeRegion(Rect{ x, y, x + w, y + h }); }
+
+    T& operator[](size_t i) { return write(i, i + 1)[i]; }
+    T value(size_t i) { return read(i, i + 1)[i]; }
+
+    // Device buffer with host changes uploaded
+    cl::Buffer& buffer() { syncDevice(); return m_buffer; }
+
+    // Device buffer for a launch, kernels writing through it make the host copy stale
+    cl::Buffer& bind(bool writable)
+    {
+        syncDevice();
+        if (writable)
+            markDeviceDirty();
+        return m_buffer;
+    }
+
+    // For writes the vector cannot see, e.g. a kernel enqueued with the raw cl::Kernel
+    void markDeviceDirty() { markDeviceDirtyRect(0, 0, m_width, m_height); }
+    void markDeviceDirtyRect(size_t x, size_t y, size_t w, size_t h)
+    {
+        collectLaunches();
+        syncDevice();
+        m_deviceDirty = m_deviceDirty.unite(Rect{ x, y, x + w, y + h });
+    }
+
+private:
+    // Element columns [x0, x1) of rows [y0, y1)
+    struct Rect
+    {
+        size_t x0, y0, x1, y1;
+
+        bool empty() const { return x0 >= x1 || y0 >= y1; }
+        bool intersects(const Rect& r) const { return !empty() && !r.empty() && x0 < r.x1 && r.x0 < x1 && y0 < r.y1 && r.y0 < y1; }
+        Rect unite(const Rect& r) const
+        {
+            if (empty()) return r;
+            if (r.empty()) return *this;
+            return Rect{ std::min(x0, r.x0), std::min(y0, r.y0), std::max(x1, r.x1), std::max(y1, r.y1) };
+        }
+    };
+
+    // Ranges spanning rows widen to full rows
+    Rect linearRect(size_t begin, size_t end) const
+    {
+        if (begin >= end || m_width == 0)
+            return Rect{ 0, 0, 0, 0 };
+
+        const size_t y0 = begin / m_width, y1 = (end - 1) / m_width + 1;
+        if (y1 - y0 == 1)
+            return Rect{ begin % m_width, y0, (end - 1) % m_width + 1, y1 };
+        return Rect{ 0, y0, m_width, y1 };
+    }
+
+    // Kernels flag launches that may have written the vector
+    void collectLaunches()
+    {
+        if (!*m_launched)
+            return;
+
+        *m_launched = false;
+        m_deviceDirty = Rect{ 0, 0, m_width, m_height };
+    }
+
+    void syncHost(const Rect& region)
+    {
+        collectLaunches();
+        if (!m_deviceDirty.intersects(region))
+            return;
+
+        // All of it, a partial download could not be tracked with one region
+        transfer(m_deviceDirty, false);
+        m_deviceDirty = Rect{ 0, 0, 0, 0 };
+    }
+
+    void syncDevice()
+    {
+        if (m_hostDirty.empty())
+            return;
+
+        transfer(m_hostDirty, true);
+        m_hostDirty = Rect{ 0, 0, 0, 0 };
+    }
+
+    // Only one side is dirty at a time, the bounding region must not cover device changes
+    T* writeRegion(const Rect& region)
+    {
+        collectLaunches();
+        if (!m_deviceDirty.empty())
+            syncHost(m_deviceDirty);
+        m_hostDirty = m_hostDirty.unite(region);
+        return m_host.data();
+    }
+
+    void transfer(const Rect& r, bool toDevice)
+    {
+        cl_int err = CL_SUCCESS;
+        const size_t rowBytes = m_width * sizeof(T);
+        if (r.x0 == 0 && r.x1 == m_width)
+        {
+            // Whole rows are contiguous
+            const size_t offset = r.y0 * rowBytes, bytes = (r.y1 - r.y0) * rowBytes;
+            unsigned char *host = (unsigned char*)m_host.data() + offset;
+            err = toDevice ? clEnqueueWriteBuffer(m_queue(), m_buffer(), CL_TRUE, offset, bytes, host, 0, nullptr, nullptr)
+                           : clEnqueueReadBuffer(m_queue(), m_buffer(), CL_TRUE, offset, bytes, host, 0, nullptr, nullptr);
+        }
+        else
+        {
+            const size_t origin[3] = { r.x0 * sizeof(T), r.y0, 0 };
+            const size_t region[3] = { (r.x1 - r.x0) * sizeof(T), r.y1 - r.y0, 1 };
+            err = toDevice ? clEnqueueWriteBufferRect(m_queue(), m_buffer(), CL_TRUE, origin, origin, region, rowBytes, 0, rowBytes, 0, m_host.data(), 0, nullptr, nullptr)
+                           : clEnqueueReadBufferRect(m_queue(), m_buffer(), CL_TRUE, origin, origin, region, rowBytes, 0, rowBytes, 0, m_host.data(), 0, nullptr, nullptr);
+        }
+        check(err, toDevice ? "Failed to upload device vector" : "Failed to download device vector");
+    }
+
+    cl::CommandQueue m_queue;
+    cl::Buffer m_buffer;
+    std::vector<T> m_host;
+    size_t m_width = 0;
+    size_t m_height = 1;
+    Rect m_hostDirty = { 0, 0, 0, 0 };   // newer on the host
+    Rect m_deviceDirty = { 0, 0, 0, 0 }; // newer on the device
+    std::shared_ptr<bool> m_launched = std::make_shared<bool>(false); // shared with kernels
+};
+
+} // end namespace clt
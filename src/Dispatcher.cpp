@@ -0,0 +1,180 @@
+#include "Dispatcher.hpp"
+#include "Kernel.hpp"
+#include "Autotuner.hpp"
+#include "HostBuffer.hpp"
+#include "utils.hpp"
+#include <mutex>
+#include <iostream>
+#include <algorithm>
+
+namespace clt {
+
+// Work items per ms of kernel time, zero until measured
+struct DeviceRates
+{
+    std::mutex mutex;
+    std::vector<double> itemsPerMs;
+};
+
+struct SliceTiming
+{
+    std::shared_ptr<DeviceRates> rates;
+    size_t queue;
+    size_t items;
+};
+
+// Owns a reference to the event, runs on a driver thread
+static void CL_CALLBACK onSliceComplete(cl_event event, cl_int status, void* userData)
+{
+    std::unique_ptr<SliceTiming> slice((SliceTiming*)userData);
+
+    cl_ulong start = 0, end = 0;
+    bool valid = (status == CL_COMPLETE) &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS;
+    clReleaseEvent(event);
+
+    if (!valid || end <= start)
+        return;
+
+    // Smoothed, single launches are noisy
+    const double rate = slice->items / ((end - start) * 1e-6);
+    std::lock_guard<std::mutex> lock(slice->rates->mutex);
+    double &r = slice->rates->itemsPerMs[slice->queue];
+    r = (r > 0.0) ? 0.7 * r + 0.3 * rate : rate;
+}
+
+Dispatcher::Dispatcher(const std::vector<cl::CommandQueue>& queues) : m_queues(queues), m_rates(std::make_shared<DeviceRates>())
+{
+    m_rates->itemsPerMs.resize(queues.size(), 0.0);
+    for (const cl::CommandQueue &queue : m_queues)
+    {
+        cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const double units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        const double clock = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+        m_prior.push_back(std::max(units * clock, 1.0));
+
+        if (m_queues.size() > 1 && !hasHostUnifiedMemory(device))
+            std::cout << "Dispatcher: " << device.getInfo<CL_DEVICE_NAME>() << " has no host-unified memory, "
+                << "concurrent slices writing one buffer are undefined" << std::endl;
+    }
+}
+
+std::vector<double> Dispatcher::shares() const
+{
+    std::vector<double> weights;
+    {
+        std::lock_guard<std::mutex> lock(m_rates->mutex);
+        weights = m_rates->itemsPerMs;
+    }
+
+    if (std::any_of(weights.begin(), weights.end(), [](double w) { return w <= 0.0; }))
+        weights = m_prior;
+
+    double total = 0.0;
+    for (double w : weights)
+        total += w;
+    for (double &w : weights)
+        w /= total;
+
+    return weights;
+}
+
+cl_int Dispatcher::enqueue(Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local,
+    const std::vector<cl::Event>* events, cl::Event* event)
+{
+    const size_t dims = global.dimensions();
+    if (dims == 0 || m_queues.empty())
+        return CL_INVALID_VALUE;
+
+    // Slices are multiples of the local size in the split dimension
+    const size_t dim = dims - 1;
+    const size_t* globalSizes = global;
+    const cl::NDRange tuned = kernel.getTunedLocalSize();
+    size_t granularity = 1;
+    if (local.dimensions() == dims)
+        granularity = ((const size_t*)local)[dim];
+    else if (tuned.dimensions() == dims)
+        granularity = ((const size_t*)tuned)[dim];
+    granularity = std::max<size_t>(granularity, 1);
+
+    const size_t extent = globalSizes[dim];
+    const size_t units = (extent + granularity - 1) / granularity;
+    const std::vector<double> share = shares();
+
+    std::vector<size_t> counts(m_queues.size());
+    size_t assigned = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        counts[i] = (size_t)(units * share[i]);
+        assigned += counts[i];
+    }
+
+    // Rounding remainder goes to the devices furthest below their share
+    while (assigned < units)
+    {
+        size_t best = 0;
+        double bestDeficit = -1.0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            const double deficit = share[i] * units - counts[i];
+            if (deficit > bestDeficit)
+            {
+                bestDeficit = deficit;
+                best = i;
+            }
+        }
+        counts[best]++;
+        assigned++;
+    }
+
+    size_t itemsPerRow = 1;
+    for (size_t d = 0; d < dim; d++)
+        itemsPerRow *= globalSizes[d];
+
+    std::vector<cl::Event> slices;
+    size_t start = 0;
+    for (size_t i = 0; i < m_queues.size() && start < extent; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+
+        size_t sizes[3] = { 0, 0, 0 };
+        size_t offsets[3] = { 0, 0, 0 };
+        std::copy(globalSizes, globalSizes + dims, sizes);
+        sizes[dim] = std::min(counts[i] * granularity, extent - start);
+        offsets[dim] = start;
+
+        cl::Event slice;
+        cl_int err = kernel.enqueue(m_queues[i], makeNDRange(sizes, dims), local, makeNDRange(offsets, dims), events, &slice);
+        if (err != CL_SUCCESS)
+            return err;
+
+        if (clRetainEvent(slice()) == CL_SUCCESS)
+        {
+            SliceTiming *timing = new SliceTiming{ m_rates, i, sizes[dim] * itemsPerRow };
+            if (clSetEventCallback(slice(), CL_COMPLETE, onSliceComplete, timing) != CL_SUCCESS)
+            {
+                delete timing;
+                clReleaseEvent(slice());
+            }
+        }
+
+        slices.push_back(slice);
+        start += sizes[dim];
+    }
+
+    if (!event)
+        return CL_SUCCESS;
+
+    if (slices.size() == 1)
+    {
+        *event = slices.front();
+        return CL_SUCCESS;
+    }
+
+    // Completes after the slices on all queues
+    return m_queues.front().enqueueMarkerWithWaitList(&slices, event);
+}
+
+} // end namespace clt
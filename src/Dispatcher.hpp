@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include "../include/cl_header.hpp"
+
+namespace clt {
+
+class Kernel;
+struct DeviceRates;
+
+// Splits launches across the devices of a multi-device context. The outermost
+// dimension is cut into contiguous slices launched with a global offset, sized by
+// the throughput measured on earlier launches. The kernel must be built for all
+// devices (Kernel::build() with a device list) and the queues need profiling.
+// Slices write disjoint ranges of the same buffers concurrently, which OpenCL 1.2
+// leaves undefined across devices: discrete drivers may migrate whole buffers and
+// keep the last writer's copy. Only use it on CPU or host-unified memory devices
+// (sub-devices of one device included), or give each slice its own output buffers.
+class Dispatcher
+{
+public:
+    // One queue per device, typically State::queues
+    Dispatcher(const std::vector<cl::CommandQueue>& queues);
+
+    // The event completes when every slice has
+    cl_int enqueue(Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local = cl::NullRange,
+        const std::vector<cl::Event>* events = nullptr, cl::Event* event = nullptr);
+
+    // Fraction of the work given to each queue by the next launch.
+    // Compute units x clock frequency until every device has been measured.
+    std::vector<double> shares() const;
+
+private:
+    std::vector<cl::CommandQueue> m_queues;
+    std::vector<double> m_prior;
+    std::shared_ptr<DeviceRates> m_rates; // updated from event callbacks
+};
+
+} // end namespace clt
@@ -0,0 +1,145 @@
+#include "HostBuffer.hpp"
+#include <algorithm>
+#include <cstdlib>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace clt {
+
+static void* allocateAligned(size_t size, size_t alignment)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    void *ptr = nullptr;
+    return (posix_memalign(&ptr, alignment, size) == 0) ? ptr : nullptr;
+#endif
+}
+
+static void freeAligned(void* ptr)
+{
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Host memory must outlive the buffer, which the driver may release after us
+static void CL_CALLBACK onBufferReleased(cl_mem, void* userData)
+{
+    freeAligned(userData);
+}
+
+bool hasHostUnifiedMemory(const cl::Device& device)
+{
+    if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)
+        return true;
+
+    return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+}
+
+HostBuffer::HostBuffer(State& state, size_t size, cl_mem_flags flags) : m_size(size)
+{
+    std::vector<cl::Device> devices = state.devices.empty() ? std::vector<cl::Device>{ state.device } : state.devices;
+    m_zeroCopy = std::all_of(devices.begin(), devices.end(), hasHostUnifiedMemory);
+
+    // Page alignment also satisfies the zero-copy rules of common CPU runtimes
+    size_t alignment = 4096;
+    for (cl::Device &device : devices)
+        alignment = std::max<size_t>(alignment, device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8); // bits
+
+    int err = CL_SUCCESS;
+    if (m_zeroCopy)
+    {
+        // Whole cache lines, some runtimes copy partially covered ones
+        const size_t allocSize = ((std::max<size_t>(size, 1) + 63) / 64) * 64;
+        void *host = allocateAligned(allocSize, alignment);
+        if (host)
+        {
+            CLT_CALL(m_buffer = cl::Buffer(state.context, flags | CL_MEM_USE_HOST_PTR, std::max<size_t>(size, 1), host, &err), err);
+            if (err != CL_SUCCESS || clSetMemObjectDestructorCallback(m_buffer(), onBufferReleased, host) != CL_SUCCESS)
+            {
+                // Nothing has been enqueued yet, the memory is not in use
+                m_buffer = cl::Buffer();
+                freeAligned(host);
+            }
+        }
+
+        // Let the runtime pick host-visible memory
+        if (!m_buffer())
+            CLT_CALL(m_buffer = cl::Buffer(state.context, flags | CL_MEM_ALLOC_HOST_PTR, std::max<size_t>(size, 1), nullptr, &err), err);
+    }
+    else
+    {
+        CLT_CALL(m_buffer = cl::Buffer(state.context, flags, std::max<size_t>(size, 1), nullptr, &err), err);
+        m_staging.resize(size);
+    }
+
+    check(err, "Failed to create host buffer");
+}
+
+void* HostBuffer::map(cl::CommandQueue& queue, cl_map_flags flags, size_t offset, size_t size)
+{
+    if (m_mapped)
+        throw std::runtime_error("HostBuffer is already mapped");
+
+    if (size == 0)
+        size = m_size - offset;
+
+    int err = CL_SUCCESS;
+    if (m_zeroCopy)
+    {
+        CLT_CALL(m_mapped = queue.enqueueMapBuffer(m_buffer, CL_TRUE, flags, offset, size, nullptr, nullptr, &err), err);
+        check(err, "Failed to map host buffer");
+    }
+    else
+    {
+        if (m_writeBack())
+        {
+            CLT_CALL(err = m_writeBack.wait(), err);
+            m_writeBack = cl::Event();
+        }
+
+        // Partial writes keep the rest of the range
+        if (!(flags & CL_MAP_WRITE_INVALIDATE_REGION))
+            CLT_CALL(err = queue.enqueueReadBuffer(m_buffer, CL_TRUE, offset, size, m_staging.data() + offset), err);
+        check(err, "Failed to read host buffer");
+
+        m_mapped = m_staging.data() + offset;
+    }
+
+    m_mapOffset = offset;
+    m_mapSize = size;
+    m_mapFlags = flags;
+    return m_mapped;
+}
+
+cl_int HostBuffer::unmap(cl::CommandQueue& queue, cl::Event* event)
+{
+    if (!m_mapped)
+        return CL_INVALID_VALUE;
+
+    cl_int err = CL_SUCCESS;
+    if (m_zeroCopy)
+    {
+        CLT_CALL(err = queue.enqueueUnmapMemObject(m_buffer, m_mapped, nullptr, event), err);
+    }
+    else if (m_mapFlags & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION))
+    {
+        // Asynchronous, the staging copy is not reused before it finishes
+        CLT_CALL(err = queue.enqueueWriteBuffer(m_buffer, CL_FALSE, m_mapOffset, m_mapSize, m_mapped, nullptr, &m_writeBack), err);
+        if (event)
+            *event = m_writeBack;
+    }
+    else if (event)
+    {
+        CLT_CALL(err = queue.enqueueMarkerWithWaitList(nullptr, event), err);
+    }
+
+    m_mapped = nullptr;
+    return err;
+}
+
+} // end namespace clt
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include "../include/cl_header.hpp"
+#include "utils.hpp"
+
+namespace clt {
+
+// Device memory shared with the host: CPU devices or CL_DEVICE_HOST_UNIFIED_MEMORY
+bool hasHostUnifiedMemory(const cl::Device& device);
+
+// Buffer accessed from the host through map()/unmap(). When every device of the
+// context shares memory with the host, the buffer wraps page-aligned host memory
+// (CL_MEM_USE_HOST_PTR) and mapping does not copy. On discrete devices map() reads
+// into a host staging copy and unmap() writes it back.
+class HostBuffer
+{
+public:
+    HostBuffer(State& state, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+
+    HostBuffer(const HostBuffer&) = delete;
+    HostBuffer& operator=(const HostBuffer&) = delete;
+
+    operator cl::Buffer&() { return m_buffer; }
+    cl::Buffer& buffer() { return m_buffer; }
+    size_t size() const { return m_size; }
+    bool isZeroCopy() const { return m_zeroCopy; }
+
+    // Blocking, one mapping at a time. Zero size maps up to the end.
+    // CL_MAP_WRITE_INVALIDATE_REGION skips reading the device contents.
+    void* map(cl::CommandQueue& queue, cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE, size_t offset = 0, size_t size = 0);
+    cl_int unmap(cl::CommandQueue& queue, cl::Event* event = nullptr);
+
+    template <typename T>
+    T* mapAs(cl::CommandQueue& queue, cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE) { return static_cast<T*>(map(queue, flags)); }
+
+private:
+    cl::Buffer m_buffer;
+    size_t m_size = 0;
+    bool m_zeroCopy = false;
+    std::vector<unsigned char> m_staging; // discrete devices
+    cl::Event m_writeBack;                // of the staging copy, finished before it is reused
+
+    void* m_mapped = nullptr;
+    size_t m_mapOffset = 0;
+    size_t m_mapSize = 0;
+    cl_map_flags m_mapFlags = 0;
+};
+
+} // end namespace clt
@@ -0,0 +1,230 @@
+#include "IncludeIndex.hpp"
+#include "utils.hpp"
+#include "KernelCache.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+
+namespace clt {
+
+static const char* INDEX_HEADER = "CLT-INCLUDE-INDEX 5";
+
+IncludeIndex& IncludeIndex::get(const std::string& cacheDir)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<IncludeIndex>> indices;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<IncludeIndex> &index = indices[cacheDir];
+    if (!index)
+        index.reset(new IncludeIndex(cacheDir + "/include_index.txt"));
+
+    return *index;
+}
+
+IncludeIndex::IncludeIndex(const std::string& indexPath) : m_indexPath(indexPath)
+{
+    load();
+}
+
+Hash128 IncludeIndex::sourceHash(const std::string& path, const std::vector<std::string>& includeDirs)
+{
+    return summary(path, includeDirs).hash;
+}
+
+std::vector<std::string> IncludeIndex::dependencies(const std::string& path, const std::vector<std::string>& includeDirs)
+{
+    return summary(path, includeDirs).files;
+}
+
+SourceSummary IncludeIndex::summary(const std::string& path, const std::vector<std::string>& includeDirs)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    SourceSummary result;
+    visit(unixifyPath(path), includeDirs, result.files);
+
+    for (const std::string &p : result.files)
+    {
+        const IncludeRecord &rec = m_records[p];
+        result.identifiers.insert(rec.identifiers.begin(), rec.identifiers.end());
+        result.observesAll |= rec.observesAll;
+    }
+
+    // Same files in the same order as the expanded source. __LINE__ expands to the
+    // line of its use, in whichever file the macro using it is invoked.
+    const bool usesLine = result.identifiers.count("__LINE__") != 0;
+    HashStream hash;
+    for (const std::string &p : result.files)
+    {
+        const IncludeRecord &rec = m_records[p];
+        hash.update(usesLine ? rec.lineHash : rec.hash);
+    }
+    result.hash = hash.digest();
+
+    if (m_dirty)
+        save();
+
+    return result;
+}
+
+// Each file is hashed once, repeated inclusions are part of the includer's tokens.
+// Unresolved includes are left to the compiler, as in expandSource().
+void IncludeIndex::visit(const std::string& path, const std::vector<std::string>& includeDirs, std::vector<std::string>& visited)
+{
+    if (std::find(visited.begin(), visited.end(), path) != visited.end())
+        return;
+
+    visited.push_back(path);
+
+    size_t idx = path.find_last_of('/');
+    const std::string dir = (idx == std::string::npos) ? "." : path.substr(0, idx);
+
+    const IncludeRecord &rec = lookup(path);
+    for (const IncludeDirective &incl : rec.includes)
+    {
+        const std::string includePath = resolveInclude(incl, dir, includeDirs);
+        if (!includePath.empty())
+            visit(includePath, includeDirs, visited);
+    }
+}
+
+const IncludeRecord& IncludeIndex::lookup(const std::string& path)
+{
+    long long size, mtime;
+    if (!getFileStat(path, size, mtime))
+    {
+        std::cout << "Cannot open file " << path << std::endl;
+        throw std::runtime_error("Cannot open file " + path);
+    }
+
+    IncludeRecord &rec = m_records[path];
+    if (rec.size == size && rec.mtime == mtime)
+        return rec;
+
+    // New or modified: parse includes and hash contents
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string contents = buffer.str();
+
+    const SourceScan scan = scanSource(contents);
+    rec.size = size;
+    rec.mtime = mtime;
+    rec.hash = scan.tokenHash;
+    rec.lineHash = scan.lineHash;
+    rec.includes = scan.includes;
+    rec.identifiers = scan.identifiers;
+    rec.observesAll = scan.observesAll;
+
+    m_dirty = true;
+    return rec;
+}
+
+// Format: header, then per file a line "size mtime hash lineHash observesAll numIncludes path"
+// followed by one line per include, written as "name" or <name>,
+// and a line of identifiers separated by spaces. False for an index of another version.
+bool IncludeIndex::readIndex(const std::string& indexPath, std::map<std::string, IncludeRecord>& records)
+{
+    std::ifstream f(indexPath);
+    if (!f)
+        return true;
+
+    std::string line;
+    if (!getline(f, line) || line != INDEX_HEADER)
+        return false;
+
+    while (getline(f, line))
+    {
+        std::istringstream ss(line);
+        IncludeRecord rec;
+        size_t numIncludes = 0;
+        std::string hash, lineHash;
+        if (!(ss >> rec.size >> rec.mtime >> hash >> lineHash >> rec.observesAll >> numIncludes) ||
+            !Hash128::fromString(hash, rec.hash) || !Hash128::fromString(lineHash, rec.lineHash))
+            break;
+
+        std::string path;
+        ss.get(); // separator
+        getline(ss, path);
+
+        for (size_t i = 0; i < numIncludes && getline(f, line); i++)
+        {
+            if (line.size() < 2)
+                continue;
+            IncludeDirective incl;
+            incl.angled = (line[0] == '<');
+            incl.name = line.substr(1, line.size() - 2);
+            rec.includes.push_back(incl);
+        }
+
+        std::string identifier;
+        std::istringstream ids(getline(f, line) ? line : "");
+        while (ids >> identifier)
+            rec.identifiers.push_back(identifier);
+
+        records[path] = rec;
+    }
+
+    return true;
+}
+
+void IncludeIndex::load()
+{
+    if (!readIndex(m_indexPath, m_records))
+        std::cout << "Ignoring outdated include index " << m_indexPath << std::endl;
+}
+
+// Published by renaming, processes sharing the cache never read a partial index.
+// Records other processes saved meanwhile are kept, the newer view of a file wins.
+void IncludeIndex::save()
+{
+    long long size, mtime;
+    const size_t slash = m_indexPath.find_last_of('/');
+    if (slash != std::string::npos && !getFileStat(m_indexPath.substr(0, slash), size, mtime))
+        return; // cache directory not created yet
+
+    FileLock lock(m_indexPath + ".lock");
+    std::map<std::string, IncludeRecord> merged;
+    readIndex(m_indexPath, merged);
+    for (const auto &it : m_records)
+    {
+        auto disk = merged.find(it.first);
+        if (disk == merged.end() || disk->second.mtime <= it.second.mtime)
+            merged[it.first] = it.second;
+    }
+
+    const std::string tmpPath = tempFilePath(m_indexPath);
+    {
+        std::ofstream f(tmpPath, std::ofstream::out | std::ofstream::trunc);
+        if (!f)
+        {
+            std::cout << "Could not write include index " << m_indexPath << std::endl;
+            return;
+        }
+
+        f << INDEX_HEADER << "\n";
+        for (const auto &it : merged)
+        {
+            const IncludeRecord &rec = it.second;
+            f << rec.size << " " << rec.mtime << " " << rec.hash.toString() << " " << rec.lineHash.toString() << " " << rec.observesAll << " " << rec.includes.size() << " " << it.first << "\n";
+            for (const IncludeDirective &incl : rec.includes)
+                f << (incl.angled ? "<" : "\"") << incl.name << (incl.angled ? ">" : "\"") << "\n";
+            for (const std::string &identifier : rec.identifiers)
+                f << identifier << " ";
+            f << "\n";
+        }
+    }
+
+    if (!replaceFile(tmpPath, m_indexPath))
+        std::remove(tmpPath.c_str());
+    else
+        m_records.swap(merged);
+
+    m_dirty = false;
+}
+
+} // end namespace clt
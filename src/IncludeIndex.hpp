@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include "Preprocessor.hpp"
+
+namespace clt {
+
+// Include graph node, validated against the file's size and mtime
+struct IncludeRecord
+{
+    long long size = -1;
+    long long mtime = 0;
+    Hash128 hash;                           // of normalized tokens
+    Hash128 lineHash;                       // with line numbers
+    std::vector<IncludeDirective> includes; // as written, in order of appearance
+    std::vector<std::string> identifiers;   // sorted, unique
+    bool observesAll = false;               // token pasting or computed includes
+};
+
+// Kernel and its transitive includes
+struct SourceSummary
+{
+    Hash128 hash;
+    std::vector<std::string> files;    // in expansion order
+    std::set<std::string> identifiers; // union over all files
+    bool observesAll = false;
+};
+
+// Persistent dependency index stored in the kernel cache directory.
+// Lets cache lookups hash a kernel's include tree with a few stat calls
+// instead of re-expanding the sources.
+class IncludeIndex
+{
+public:
+    // Process-wide index for a cache directory
+    static IncludeIndex& get(const std::string& cacheDir);
+
+    // Hash of a kernel and its transitive includes, comments and whitespace are ignored.
+    // Line numbers are hashed as well when one of the files uses __LINE__.
+    Hash128 sourceHash(const std::string& path, const std::vector<std::string>& includeDirs = {});
+
+    // Kernel and its transitive includes, in expansion order
+    std::vector<std::string> dependencies(const std::string& path, const std::vector<std::string>& includeDirs = {});
+
+    // Hash, dependencies and referenced identifiers in one traversal
+    SourceSummary summary(const std::string& path, const std::vector<std::string>& includeDirs = {});
+
+private:
+    explicit IncludeIndex(const std::string& indexPath);
+
+    // Record for an unchanged file, reparsed if stale. Caller holds m_mutex.
+    const IncludeRecord& lookup(const std::string& path);
+    void visit(const std::string& path, const std::vector<std::string>& includeDirs, std::vector<std::string>& visited);
+
+    static bool readIndex(const std::string& indexPath, std::map<std::string, IncludeRecord>& records);
+    void load();
+    void save();
+
+    std::string m_indexPath;
+    std::map<std::string, IncludeRecord> m_records;
+    std::mutex m_mutex;
+    bool m_dirty = false;
+};
+
+} // end namespace clt
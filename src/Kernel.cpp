@@ -1,18 +1,162 @@
 #include "Kernel.hpp"
 #include "kernelreader.hpp"
+#include "ThreadPool.hpp"
+#include "IncludeIndex.hpp"
+#include "SourceWatcher.hpp"
+#include "KernelCache.hpp"
+#include "ProgramCache.hpp"
+#include "KernelStats.hpp"
+#include "Autotuner.hpp"
+#include "Preprocessor.hpp"
 #include <iostream>
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
 #include "utils.hpp"
 
 namespace clt {
 
 std::string Kernel::globalBuildOpts = "";
 std::string Kernel::cacheDir = "cache/kernel_binaries";
+CacheFormat Kernel::cacheFormat = CacheFormat::Files;
 bool Kernel::CPU_DEBUG = false;
+bool Kernel::HOT_RELOAD = false;
+size_t Kernel::variantCacheSize = 4;
 void* Kernel::userPtr = nullptr;
 
+// Function-local statics: kernels are often constructed as globals
+static std::mutex& registryMutex()
+{
+    static std::mutex m;
+    return m;
+}
+
+static std::vector<Kernel*>& kernelRegistry()
+{
+    static std::vector<Kernel*> kernels;
+    return kernels;
+}
+
+Kernel::Kernel(std::string srcPath, std::string entryPoint) : m_sourcePath(srcPath), m_entryPoint(entryPoint)
+{
+    std::lock_guard<std::mutex> lock(registryMutex());
+    kernelRegistry().push_back(this);
+}
+
+Kernel::~Kernel(void)
+{
+    if (m_watched)
+        SourceWatcher::get().unwatch(this);
+
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::vector<Kernel*> &reg = kernelRegistry();
+    reg.erase(std::remove(reg.begin(), reg.end(), this), reg.end());
+}
+
+std::vector<BuildResult> Kernel::buildAll(cl::Context& context, cl::Device& device, cl::Platform& platform,
+    unsigned numThreads, std::function<void(const BuildResult&)> onBuilt)
+{
+    return buildRegistered([&](Kernel &k) { k.build(context, device, platform); }, numThreads, onBuilt);
+}
+
+std::vector<BuildResult> Kernel::buildAll(cl::Context& context, std::vector<cl::Device>& devices, cl::Platform& platform,
+    unsigned numThreads, std::function<void(const BuildResult&)> onBuilt)
+{
+    return buildRegistered([&](Kernel &k) { k.build(context, devices, platform); }, numThreads, onBuilt);
+}
+
+std::vector<BuildResult> Kernel::buildRegistered(std::function<void(Kernel&)> build, unsigned numThreads,
+    std::function<void(const BuildResult&)> onBuilt)
+{
+    std::vector<Kernel*> kernels;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        kernels = kernelRegistry();
+    }
+
+    // ThreadPool(0) would spawn hardware_concurrency workers
+    if (kernels.empty())
+        return {};
+
+    std::vector<BuildResult> results(kernels.size());
+    std::mutex callbackMutex;
+
+    // No point in spawning more workers than there are kernels
+    unsigned threads = numThreads ? numThreads : std::thread::hardware_concurrency();
+    threads = (unsigned)std::min((size_t)threads, kernels.size());
+    ThreadPool pool(threads);
+    for (size_t i = 0; i < kernels.size(); i++)
+    {
+        pool.submit([&, i]()
+        {
+            BuildResult &res = results[i];
+            res.kernel = kernels[i];
+
+            auto t0 = std::chrono::steady_clock::now();
+            try
+            {
+                build(*res.kernel);
+            }
+            catch (std::exception &e)
+            {
+                res.err = CL_BUILD_PROGRAM_FAILURE;
+                res.error = e.what();
+            }
+            res.buildLog = res.kernel->getBuildLog();
+            res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+            if (onBuilt)
+            {
+                std::lock_guard<std::mutex> lock(callbackMutex);
+                onBuilt(res);
+            }
+        });
+    }
+
+    pool.wait();
+
+    size_t failed = std::count_if(results.begin(), results.end(), [](const BuildResult &r) { return r.err != CL_SUCCESS; });
+    std::cout << "Built " << (results.size() - failed) << "/" << results.size() << " kernels on " << pool.size() << " threads" << std::endl;
+
+    return results;
+}
+
+// Inputs captured on the calling thread, outputs produced by the compiling thread
+struct Kernel::BuildProducts
+{
+    cl::Context context;
+    cl::Device device;
+    cl::Platform platform;
+    std::string sourcePath;
+    std::string entryPoint;
+    std::string buildOpts;
+    std::string observedOpts; // unreferenced defines removed
+    std::string variant;      // for launch statistics
+    std::vector<std::string> includeDirs;
+    std::vector<std::string> libraries;
+    std::vector<cl::Device> extraDevices; // built together with device
+    bool cpuDebug = false;
+    SourceSummary source;
+
+    cl::Kernel kernel;
+    std::shared_ptr<ProgramUse> programUse;
+    std::string buildLog;
+    std::string cacheKey;
+    std::vector<ArgEntry> argTable;
+    cl::NDRange tunedLocal;
+    std::vector<DeviceKernel> extraKernels; // by extraDevices
+};
+
 void Kernel::build(cl::Context& context, cl::Device& device, cl::Platform& platform, bool setArgs)
 {
+    // A synchronous build supersedes background builds
+    waitPendingBuild();
+
     // No need to recompile, just update arguments
     if (m_kernel() && !configHasChanged())
     {
@@ -21,62 +165,367 @@ void Kernel::build(cl::Context& context, cl::Device& device, cl::Platform& platf
         return;
     }
 
+    std::shared_ptr<BuildProducts> products = prepareBuild(context, device, platform, getAdditionalBuildOptions());
+
+    // Recently used variants are swapped in without touching the driver
+    std::shared_ptr<BuildProducts> cached = findVariant(*products);
+    if (cached)
+    {
+        installBuild(cached, setArgs);
+        return;
+    }
+
+    if (m_kernel())
+        std::cout << "Rebuilding kernel " << getFileName(m_sourcePath) << std::endl;
+
+    compileBuild(*products);
+    installBuild(products, setArgs);
+}
+
+std::shared_future<BuildResult> Kernel::buildAsync(cl::Context& context, cl::Device& device, cl::Platform& platform, bool setArgs)
+{
+    applyPendingBuild();
+
+    BuildResult current;
+    current.kernel = this;
+    current.buildLog = m_buildLog;
+
+    // Same options as the build in progress
+    if (m_pending)
+    {
+        const std::string opts = buildOptions(getAdditionalBuildOptions());
+        const SourceSummary &source = m_pending->source;
+        if (m_pending->observedOpts == (source.observesAll ? opts : filterDefines(opts, source.identifiers)))
+            return m_pendingResult;
+    }
+
+    if (!m_pending && m_kernel() && !configHasChanged())
+    {
+        if (setArgs)
+            this->setArgs();
+
+        std::promise<BuildResult> ready;
+        ready.set_value(current);
+        return ready.get_future().share();
+    }
+
+    std::shared_ptr<BuildProducts> products = prepareBuild(context, device, platform, getAdditionalBuildOptions());
+    std::shared_ptr<BuildProducts> cached = findVariant(*products);
+    if (cached)
+    {
+        installBuild(cached, setArgs);
+        current.buildLog = m_buildLog;
+
+        std::promise<BuildResult> ready;
+        ready.set_value(current);
+        return ready.get_future().share();
+    }
+
+    if (m_kernel())
+        std::cout << "Rebuilding kernel " << getFileName(m_sourcePath) << " in the background" << std::endl;
+
+    m_pending = products;
+    m_pendingSetArgs = setArgs;
+    m_pendingResult = startBuild(products);
+
+    return m_pendingResult;
+}
+
+// Compiles on a detached thread, errors are reported through the result.
+// Unlike std::async, dropping the future of a superseded build does not wait for it.
+std::shared_future<BuildResult> Kernel::startBuild(std::shared_ptr<BuildProducts> products)
+{
+    Kernel *kernel = this;
+    std::shared_ptr<std::promise<BuildResult>> promise = std::make_shared<std::promise<BuildResult>>();
+    std::shared_future<BuildResult> result = promise->get_future().share();
+    std::thread([products, kernel, promise]()
+    {
+        BuildResult res;
+        res.kernel = kernel;
+
+        auto t0 = std::chrono::steady_clock::now();
+        try
+        {
+            compileBuild(*products);
+        }
+        catch (std::exception &e)
+        {
+            res.err = CL_BUILD_PROGRAM_FAILURE;
+            res.error = e.what();
+        }
+        res.buildLog = products->buildLog;
+        res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        promise->set_value(res);
+    }).detach();
+
+    return result;
+}
+
+void Kernel::precompileVariants(const std::vector<std::string>& additionalOpts)
+{
+    if (!m_kernel())
+        throw std::runtime_error("Kernel " + getFileName(m_sourcePath) + " must be built before precompiling variants");
+
+    for (const std::string &opts : additionalOpts)
+    {
+        std::shared_ptr<BuildProducts> products = prepareBuild(*context, *device, *platform, opts);
+        const std::string key = variantKey(*products);
+        
+        bool known = (findVariant(*products) != nullptr) || (m_pending && variantKey(*m_pending) == key);
+        for (const PendingVariant &v : m_precompiling)
+            known |= (variantKey(*v.products) == key);
+
+        if (!known)
+            m_precompiling.push_back({ products, startBuild(products) });
+    }
+}
+
+// Identifies a build by everything that can change the binary
+std::string Kernel::variantKey(const BuildProducts& p)
+{
+    std::ostringstream key;
+    key << p.observedOpts << "@" << (const void*)p.context() << "/" << (const void*)p.device();
+    for (const cl::Device &d : p.extraDevices)
+        key << "," << (const void*)d();
+    key << "#" << p.source.hash.toString();
+    return key.str();
+}
+
+std::shared_ptr<Kernel::BuildProducts> Kernel::findVariant(const BuildProducts& p)
+{
+    // Finished background compiles join the cache, failed ones are dropped
+    for (auto it = m_precompiling.begin(); it != m_precompiling.end();)
+    {
+        if (it->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            ++it;
+            continue;
+        }
+
+        const BuildResult &res = it->result.get();
+        if (res.err == CL_SUCCESS)
+            storeVariant(it->products);
+        else
+            std::cout << "Precompiling variant of " << getFileName(it->products->sourcePath) << " failed: " << res.error << std::endl;
+        it = m_precompiling.erase(it);
+    }
+
+    const std::string key = variantKey(p);
+    for (auto it = m_variants.begin(); it != m_variants.end(); ++it)
+    {
+        if (variantKey(**it) == key)
+        {
+            // Most recently used first
+            m_variants.splice(m_variants.begin(), m_variants, it);
+            return m_variants.front();
+        }
+    }
+
+    return nullptr;
+}
+
+void Kernel::storeVariant(std::shared_ptr<BuildProducts> products)
+{
+    const std::string key = variantKey(*products);
+    m_variants.remove_if([&](const std::shared_ptr<BuildProducts> &v) { return variantKey(*v) == key; });
+    m_variants.push_front(products);
+    while (m_variants.size() > std::max<size_t>(Kernel::variantCacheSize, 1))
+        m_variants.pop_back();
+}
+
+std::shared_future<BuildResult> Kernel::rebuildAsync(bool setArgs)
+{
+    return buildAsync(*context, *device, *platform, setArgs);
+}
+
+bool Kernel::isBuilding() const
+{
+    return m_pending && m_pendingResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+// Failed builds leave the current kernel in place, the next rebuild tries again
+bool Kernel::applyPendingBuild()
+{
+    if (!m_pending || isBuilding())
+        return false;
+
+    std::shared_ptr<BuildProducts> products = m_pending;
+    m_pending.reset();
+
+    const BuildResult &res = m_pendingResult.get();
+    if (res.err != CL_SUCCESS)
+    {
+        std::cout << "Background build of " << getFileName(products->sourcePath) << " failed: " << res.error << std::endl;
+        m_buildLog = res.buildLog;
+        return false;
+    }
+
+    installBuild(products, m_pendingSetArgs);
+    return true;
+}
+
+void Kernel::waitPendingBuild()
+{
+    if (m_pending)
+    {
+        m_pendingResult.wait();
+        applyPendingBuild();
+    }
+}
+
+std::string Kernel::buildOptions(const std::string& additionalOpts)
+{
+    // Tuned definitions depend on the device and configuration
+    if (!m_defineSpace.empty())
+        loadTunedDefines();
+
+    // Define build options based on global + specialized options
+    std::string buildOpts = globalBuildOpts + additionalOpts + defineOptions();
+    buildOpts += " -cl-kernel-arg-info";
+    if (Kernel::CPU_DEBUG && deviceIsCPU)
+        buildOpts += " -g -s \"" + getAbsolutePath(m_sourcePath) + "\"";
+    return buildOpts;
+}
+
+// Runs on the calling thread, everything that touches the kernel object or virtuals
+std::shared_ptr<Kernel::BuildProducts> Kernel::prepareBuild(cl::Context& context, cl::Device& device, cl::Platform& platform,
+    const std::string& additionalOpts)
+{
     // Inlined kernels are saved to temporary files
     if (isInlined())
         m_sourcePath = createTempKernelFile(getSource(), m_entryPoint);
 
-    const std::string filename = getFileName(m_sourcePath);
-
     this->context = &context;
     this->device = &device;
     this->platform = &platform;
     this->deviceIsCPU = (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
 
-    if (m_kernel())
-        std::cout << "Rebuilding kernel " << filename << std::endl;
+    std::shared_ptr<BuildProducts> products = std::make_shared<BuildProducts>();
+    products->context = context;
+    products->device = device;
+    products->platform = platform;
+    products->sourcePath = m_sourcePath;
+    products->entryPoint = m_entryPoint;
+    products->buildOpts = buildOptions(additionalOpts);
+    products->cpuDebug = Kernel::CPU_DEBUG;
 
-    // Define build options based on global + specialized options
-    std::string buildOpts = globalBuildOpts + getAdditionalBuildOptions();
-    buildOpts += " -cl-kernel-arg-info";
-    if (Kernel::CPU_DEBUG && deviceIsCPU)
-        buildOpts += " -g -s \"" + getAbsolutePath(m_sourcePath) + "\"";
-    this->lastBuildOpts = buildOpts;
+    // Definitions the sources never reference do not trigger rebuilds
+    products->includeDirs = includeDirsFromOptions(products->buildOpts);
+    products->libraries = m_libraries;
+    products->extraDevices = m_extraDevices;
+    // The change check of a rebuild has just summarized the same sources
+    std::shared_ptr<SourceSummary> checked;
+    checked.swap(m_checkedSource);
+    if (checked)
+    {
+        SourceWatcher::get().poll();
+        if (SourceWatcher::get().isDirty(this) || products->includeDirs != m_includeDirs)
+            checked.reset();
+    }
+    products->source = checked ? *checked : summarizeSources(products->includeDirs);
+    products->observedOpts = products->source.observesAll ? products->buildOpts :
+        filterDefines(products->buildOpts, products->source.identifiers);
+
+    // Launch timings are kept per variant
+    products->variant = additionalOpts;
+    products->variant.erase(0, products->variant.find_first_not_of(' '));
+
+    // Start watching before compiling so that edits made during the build are not lost
+    if (Kernel::HOT_RELOAD && !isInlined())
+    {
+        SourceWatcher::get().watch(this, products->source.files);
+        m_watched = true;
+    }
+
+    return products;
+}
+
+// Program and kernel for one device, each device gets its own cached binary
+void Kernel::compileForDevice(const BuildProducts& p, cl::Device& device, DeviceKernel& out, std::string& buildLog)
+{
+    const std::string filename = getFileName(p.sourcePath);
     cl::Program program;
+    out.device = device;
 
     // CPU debugging segfaults if trying to use cached kernel!
     // Also need to let the driver do the include handling
     int err = 0;
-    if (Kernel::CPU_DEBUG)
+    if (p.cpuDebug)
     {
-        kernelFromSource(m_sourcePath, context, program, err);
+        if (!p.libraries.empty())
+            throw std::runtime_error("Kernel libraries are not supported with CPU debugging (" + filename + ")");
+
+        cl::Context context = p.context;
+        kernelFromSource(p.sourcePath, context, program, err);
         std::vector<cl::Device> devices = { device };
-        CLT_CALL(err = program.build(devices, buildOpts.c_str()), err);
+        err = buildProgram(program, devices, p.buildOpts);
         
         // Check build log
-        m_buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-        if (m_buildLog.length() > 2)
-            std::cout << "\n[" << m_sourcePath << " build log]:" << m_buildLog << std::endl;
+        buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        if (buildLog.length() > 2)
+            std::cout << "\n[" << p.sourcePath << " build log]:" << buildLog << std::endl;
 
         check(err, "Kernel compilation failed");
     }
     else
     {
         // Build program using cache or sources
-        CLT_CALL(program = kernelFromFile(m_sourcePath, buildOpts, Kernel::cacheDir, platform, context, device, err), err);
+        cl::Platform platform = p.platform;
+        cl::Context context = p.context;
+        CLT_CALL(program = kernelFromFile(p.sourcePath, p.buildOpts, getCache(), platform, context, device, err, &out.cacheKey, p.libraries), err);
         check(err, "Failed to create kernel program");
-        CLT_CALL(m_buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device, &err), err);
+        CLT_CALL(buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device, &err), err);
         check(err, "Failed to get program build log");
     }
 
-    // Creating compute kernel from program
-    CLT_CALL(m_kernel = cl::Kernel(program, m_entryPoint.c_str(), &err), err);
+    // Creating compute kernel from program, shared programs hand out kernels created in one batch
+    CLT_CALL(out.kernel = ProgramCache::get().createKernel(program, p.entryPoint, &err, &out.programUse), err);
     check(err, "Failed to create compute kernel!");
 
+    // Tuning results are stored per binary
+    out.tunedLocal = cl::NullRange;
+    BinaryView tuned;
+    if (!out.cacheKey.empty() && getCache().find(out.cacheKey + ".wgs", tuned))
+        parseNDRange(std::string((const char*)tuned.data, tuned.size), out.tunedLocal);
+}
+
+// Does not touch the kernel object, safe to run on any thread
+void Kernel::compileBuild(BuildProducts& p)
+{
+    const std::string filename = getFileName(p.sourcePath);
+
+    // Other devices of the context compile concurrently
+    std::vector<std::future<void>> others;
+    p.extraKernels.resize(p.extraDevices.size());
+    for (size_t i = 0; i < p.extraDevices.size(); i++)
+    {
+        DeviceKernel *out = &p.extraKernels[i];
+        cl::Device *device = &p.extraDevices[i];
+        others.push_back(std::async(std::launch::async, [&p, out, device]()
+        {
+            std::string buildLog;
+            compileForDevice(p, *device, *out, buildLog);
+        }));
+    }
+
+    DeviceKernel primary;
+    compileForDevice(p, p.device, primary, p.buildLog);
+    p.kernel = primary.kernel;
+    p.programUse = primary.programUse;
+    p.cacheKey = primary.cacheKey;
+    p.tunedLocal = primary.tunedLocal;
+
+    // Rethrows failures on other devices
+    for (std::future<void> &f : others)
+        f.get();
+
+    int err = 0;
+
     // Get kernel argument names
     // NB: kernels built from binaries SHOULD NOT have arg info, but they do at least on Intel/NV!
-    argMap.clear();
     cl_uint numArgs;
-    CLT_CALL(numArgs = m_kernel.getInfo<CL_KERNEL_NUM_ARGS>(&err), err);
+    CLT_CALL(numArgs = p.kernel.getInfo<CL_KERNEL_NUM_ARGS>(&err), err);
     check(err, "Getting KERNEL_NUM_ARGS failed for " + filename);
     
     // Copied into temp buffer because cl.hpp seems to produce invalid strings somehow
@@ -85,14 +534,527 @@ void Kernel::build(cl::Context& context, cl::Device& device, cl::Platform& platf
     for (cl_uint i = 0; i < numArgs; i++)
     {
         std::string argname;
-        CLT_CALL(argname = m_kernel.getArgInfo<CL_KERNEL_ARG_NAME>(i, &err), err);
+        CLT_CALL(argname = p.kernel.getArgInfo<CL_KERNEL_ARG_NAME>(i, &err), err);
         check(err, "Getting CL_KERNEL_ARG_NAME failed for " + filename);
         snprintf(buffer, sizeof(buffer), "%s", argname.c_str());
-        argMap[buffer] = i; // save to mapping
+
+        // Unknown qualifiers are treated as writable
+        cl_kernel_arg_type_qualifier qualifier = 0;
+        CLT_CALL(qualifier = p.kernel.getArgInfo<CL_KERNEL_ARG_TYPE_QUALIFIER>(i, &err), err);
+        const bool isConst = (err == CL_SUCCESS) && (qualifier & CL_KERNEL_ARG_TYPE_CONST);
+
+        p.argTable.push_back({ std::hash<std::string>()(buffer), buffer, i, isConst }); // save to mapping
     }
+}
+
+// Swaps the new kernel in on the calling thread
+// Arguments carry over by name, also when swapped in during a launch
+void Kernel::installBuild(std::shared_ptr<BuildProducts> products, bool setArgs)
+{
+    const BuildProducts &p = *products;
+    const ArgSnapshot previous = snapshotArgs();
+    storeVariant(products);
+    m_current = products;
+
+    m_kernel = p.kernel;
+    m_buildLog = p.buildLog;
+    m_cacheKey = p.cacheKey;
+    m_tunedLocal = p.tunedLocal;
+    m_deviceKernels = p.extraKernels;
+    m_argTable = p.argTable;
+    m_argValues.clear();
+    m_argVersion++;
+    m_buildId++;
+
+    this->lastBuildOpts = p.observedOpts;
+    m_identifiers = p.source.identifiers;
+    m_observesAll = p.source.observesAll;
+    m_sourceHash = p.source.hash;
+    m_includeDirs = p.includeDirs;
+
+    // Handles keep their slots, arguments may have moved
+    for (ArgSlot &slot : m_argSlots)
+        slot.index = findArg(slot.name);
+
+    for (BoundVector &bound : m_boundVectors)
+        bound.index = findArg(bound.name);
+    m_boundVectors.erase(std::remove_if(m_boundVectors.begin(), m_boundVectors.end(),
+        [](const BoundVector& b) { return b.index == NO_ARG; }), m_boundVectors.end());
+
+    m_timings = KernelStats::get().series(getFileName(p.sourcePath) + ":" + p.entryPoint, p.variant);
+
+    cl_int err = CL_SUCCESS;
+    CLT_CALL(err = restoreArgs(previous), err);
+    if (err != CL_SUCCESS)
+        std::cout << "Could not restore arguments of " << getFileName(p.sourcePath) << " after rebuild: " << getCLErrorString(err) << std::endl;
 
     // Set default arguments
-    this->setArgs();
+    if (setArgs)
+        this->setArgs();
+}
+
+// Owns a reference to the event and the series, runs on a driver thread
+static void CL_CALLBACK onLaunchComplete(cl_event event, cl_int status, void* userData)
+{
+    std::unique_ptr<std::shared_ptr<LaunchSeries>> series((std::shared_ptr<LaunchSeries>*)userData);
+
+    const cl_profiling_info params[4] = { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+    cl_ulong times[4] = { 0 };
+
+    bool valid = (status == CL_COMPLETE);
+    for (int i = 0; i < 4 && valid; i++)
+        valid = (clGetEventProfilingInfo(event, params[i], sizeof(cl_ulong), &times[i], NULL) == CL_SUCCESS);
+
+    if (valid)
+        (*series)->add(times[0], times[1], times[2], times[3]);
+
+    clReleaseEvent(event);
+    KernelStats::get().endLaunch();
+}
+
+// Kernels of other devices in the context run on their queues
+void Kernel::selectKernel(cl::CommandQueue& queue, cl::Kernel*& kernel, cl::NDRange*& tunedLocal)
+{
+    kernel = &m_kernel;
+    tunedLocal = &m_tunedLocal;
+    if (m_deviceKernels.empty())
+        return;
+
+    cl_device_id queueDevice = queue.getInfo<CL_QUEUE_DEVICE>()();
+    for (DeviceKernel &dk : m_deviceKernels)
+    {
+        if (dk.device() == queueDevice)
+        {
+            kernel = &dk.kernel;
+            tunedLocal = &dk.tunedLocal;
+        }
+    }
+}
+
+cl_int Kernel::enqueue(cl::CommandQueue& queue, const cl::NDRange& global, const cl::NDRange& local,
+    const cl::NDRange& offset, const std::vector<cl::Event>* events, cl::Event* event)
+{
+    // Background builds are swapped in between launches
+    if (m_pending)
+        applyPendingBuild();
+
+    cl::Kernel *kernel = nullptr;
+    cl::NDRange *tunedLocal = nullptr;
+    selectKernel(queue, kernel, tunedLocal);
+    syncVectors();
+
+    const bool useTuned = (local.dimensions() == 0 && localSizeFits(global, *tunedLocal));
+
+    cl::Event launch;
+    cl_int err = queue.enqueueNDRangeKernel(*kernel, offset, global, useTuned ? *tunedLocal : local, events, &launch);
+    if (err != CL_SUCCESS)
+        return err;
+    markVectorsWritten();
+
+    // Harvested asynchronously, the host never waits for the timings
+    if (m_timings && clRetainEvent(launch()) == CL_SUCCESS)
+    {
+        auto *series = new std::shared_ptr<LaunchSeries>(m_timings);
+        KernelStats::get().beginLaunch();
+        if (clSetEventCallback(launch(), CL_COMPLETE, onLaunchComplete, series) != CL_SUCCESS)
+        {
+            delete series;
+            clReleaseEvent(launch());
+            KernelStats::get().endLaunch();
+        }
+    }
+
+    if (event)
+        *event = launch;
+
+    return CL_SUCCESS;
+}
+
+// Tunes the kernel of the queue's device, results are kept per device
+cl::NDRange Kernel::autotune(cl::CommandQueue& queue, const cl::NDRange& global, int repeats)
+{
+    cl_int err = CL_SUCCESS;
+    cl::Device queueDevice;
+    CLT_CALL(queueDevice = queue.getInfo<CL_QUEUE_DEVICE>(&err), err);
+    check(err, "Getting CL_QUEUE_DEVICE failed");
+
+    cl::Kernel *kernel = &m_kernel;
+    cl::NDRange *tunedLocal = &m_tunedLocal;
+    cl::NDRange *storedLocal = m_current ? &m_current->tunedLocal : nullptr;
+    std::string cacheKey = m_cacheKey;
+    for (size_t i = 0; i < m_deviceKernels.size(); i++)
+    {
+        DeviceKernel &dk = m_deviceKernels[i];
+        if (dk.device() != queueDevice())
+            continue;
+
+        kernel = &dk.kernel;
+        tunedLocal = &dk.tunedLocal;
+        storedLocal = (m_current && i < m_current->extraKernels.size()) ? &m_current->extraKernels[i].tunedLocal : nullptr;
+        cacheKey = dk.cacheKey;
+    }
+
+    size_t maxGroupSize = 0, multiple = 1;
+    std::vector<size_t> maxItemSizes;
+    CLT_CALL(maxGroupSize = kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(queueDevice, &err), err);
+    check(err, "Getting CL_KERNEL_WORK_GROUP_SIZE failed");
+    CLT_CALL(multiple = kernel->getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(queueDevice, &err), err);
+    check(err, "Getting CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE failed");
+    CLT_CALL(maxItemSizes = queueDevice.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>(&err), err);
+    check(err, "Getting CL_DEVICE_MAX_WORK_ITEM_SIZES failed");
+
+    const std::string filename = getFileName(m_sourcePath);
+    std::cout << "Autotuning local size of " << filename << ":" << m_entryPoint << std::endl;
+
+    double bestTime = -1.0;
+    cl::NDRange best = cl::NullRange;
+    for (const cl::NDRange &local : localSizeCandidates(global, maxGroupSize, multiple, maxItemSizes))
+    {
+        // Unlaunchable candidates (resources, required sizes) are skipped
+        double time = timeLaunches(queue, *kernel, global, local, repeats);
+        if (time >= 0.0 && (bestTime < 0.0 || time < bestTime))
+        {
+            bestTime = time;
+            best = local;
+        }
+    }
+
+    if (bestTime < 0.0)
+        throw std::runtime_error("Autotuning failed, kernel " + filename + " could not be launched");
+
+    std::cout << "Best local size [" << formatNDRange(best) << "]: " << bestTime << " ms" << std::endl;
+    *tunedLocal = best;
+    if (storedLocal)
+        *storedLocal = best;
+
+    // Later runs with the same binary skip tuning
+    if (!cacheKey.empty())
+    {
+        const std::string value = formatNDRange(best);
+        getCache().store(cacheKey + ".wgs", value.data(), value.size());
+    }
+
+    return best;
+}
+
+void Kernel::declareDefine(const std::string& name, const std::vector<std::string>& values)
+{
+    if (values.empty())
+        throw std::runtime_error("No values declared for define " + name);
+
+    for (auto &it : m_defineSpace)
+    {
+        if (it.first == name)
+        {
+            it.second = values;
+            m_defineKey.clear(); // space changed, reload
+            return;
+        }
+    }
+
+    m_defineSpace.push_back(std::make_pair(name, values));
+    m_defineKey.clear();
+}
+
+std::string Kernel::defineOptions()
+{
+    std::string opts;
+    for (const auto &it : m_defineValues)
+        opts += " -D" + it.first + "=" + it.second;
+    return opts;
+}
+
+// Tuning results are specific to the device, the search space and the other build options
+std::string Kernel::defineCacheKey()
+{
+    HashStream hash;
+    hash.update(globalBuildOpts + getAdditionalBuildOptions());
+    hash.update(platform->getInfo<CL_PLATFORM_NAME>());
+    hash.update(device->getInfo<CL_DEVICE_NAME>());
+    for (const auto &it : m_defineSpace)
+    {
+        const unsigned long long numValues = it.second.size();
+        hash.update(it.first);
+        hash.update(&numValues, sizeof(numValues));
+        for (const std::string &value : it.second)
+            hash.update(value);
+    }
+
+    return getFileName(m_sourcePath) + "." + m_entryPoint + "." + hash.digest().toString() + ".defs";
+}
+
+void Kernel::loadTunedDefines()
+{
+    const std::string key = defineCacheKey();
+    if (key == m_defineKey)
+        return;
+
+    m_defineKey = key;
+    m_defineValues.clear();
+    for (const auto &it : m_defineSpace)
+        m_defineValues[it.first] = it.second.front();
+
+    // Stored as name=value lines
+    BinaryView tuned;
+    if (!getCache().find(key, tuned))
+        return;
+
+    std::istringstream in(std::string((const char*)tuned.data, tuned.size));
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t eq = line.find('=');
+        if (eq != std::string::npos && m_defineValues.count(line.substr(0, eq)))
+            m_defineValues[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+}
+
+std::map<std::string, std::string> Kernel::tuneDefines(cl::CommandQueue& queue, std::function<void(Kernel&)> launch, int repeats)
+{
+    if (!m_kernel())
+        throw std::runtime_error("Kernel must be built before tuning");
+
+    // All combinations, the last declared define varies fastest
+    std::vector<std::map<std::string, std::string>> variants(1);
+    for (const auto &it : m_defineSpace)
+    {
+        std::vector<std::map<std::string, std::string>> expanded;
+        for (const auto &partial : variants)
+        {
+            for (const std::string &value : it.second)
+            {
+                expanded.push_back(partial);
+                expanded.back()[it.first] = value;
+            }
+        }
+        variants.swap(expanded);
+    }
+
+    const std::string filename = getFileName(m_sourcePath);
+    std::cout << "Tuning " << variants.size() << " define variants of " << filename << ":" << m_entryPoint << std::endl;
+
+    // Builds reload stored values when the key is stale, which would undo the first variant
+    loadTunedDefines();
+
+    double bestTime = -1.0;
+    std::map<std::string, std::string> best;
+    for (const auto &variant : variants)
+    {
+        m_defineValues = variant;
+        try
+        {
+            build(*context, *device, *platform);
+
+            // First run includes lazy driver work
+            launch(*this);
+            check(queue.finish(), "Tuning launch failed");
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < repeats; i++)
+                launch(*this);
+            check(queue.finish(), "Tuning launch failed");
+            double time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / std::max(repeats, 1);
+
+            std::cout << "   " << defineOptions() << ": " << time << " ms" << std::endl;
+            if (bestTime < 0.0 || time < bestTime)
+            {
+                bestTime = time;
+                best = variant;
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cout << "   " << defineOptions() << ": skipped (" << e.what() << ")" << std::endl;
+        }
+    }
+
+    if (bestTime < 0.0)
+        throw std::runtime_error("Define tuning failed, no variant of " + filename + " could be built and launched");
+
+    std::string stored;
+    for (const auto &it : best)
+        stored += it.first + "=" + it.second + "\n";
+    getCache().store(defineCacheKey(), stored.data(), stored.size());
+
+    // Later builds pick up the stored values
+    m_defineKey.clear();
+    build(*context, *device, *platform);
+    std::cout << "Best defines" << defineOptions() << ": " << bestTime << " ms" << std::endl;
+
+    return best;
+}
+
+ArgHandle Kernel::getArgHandle(const std::string& name)
+{
+    ArgHandle handle;
+    for (size_t i = 0; i < m_argSlots.size(); i++)
+    {
+        if (m_argSlots[i].name == name)
+        {
+            handle.slot = (cl_uint)i;
+            return handle;
+        }
+    }
+
+    handle.slot = (cl_uint)m_argSlots.size();
+    m_argSlots.push_back({ name, findArg(name) });
+    return handle;
+}
+
+cl_uint Kernel::findArg(const std::string& name) const
+{
+    const size_t hash = std::hash<std::string>()(name);
+    for (const ArgEntry &arg : m_argTable)
+    {
+        if (arg.hash == hash && arg.name == name)
+            return arg.index;
+    }
+
+    return NO_ARG;
+}
+
+bool Kernel::argIsWritable(cl_uint index) const
+{
+    for (const ArgEntry &arg : m_argTable)
+    {
+        if (arg.index == index)
+            return !arg.isConst;
+    }
+
+    return true;
+}
+
+// Skips calls that would not change the argument
+cl_int Kernel::setArgBytes(cl_uint index, size_t size, const void* value)
+{
+    if (index >= m_argValues.size())
+        m_argValues.resize(index + 1);
+
+    ArgValue &arg = m_argValues[index];
+    const bool isLocal = (value == nullptr);
+    if (arg.isSet && arg.size == size && arg.isLocal == isLocal &&
+        (isLocal || memcmp(arg.bytes.data(), value, size) == 0))
+        return CL_SUCCESS;
+
+    // A vector stays bound until the argument is given another value
+    auto replaced = [&](const BoundVector& b)
+    {
+        return b.index == index && (size != sizeof(cl_mem) || isLocal || memcmp(value, &b.buffer, sizeof(cl_mem)) != 0);
+    };
+    m_boundVectors.erase(std::remove_if(m_boundVectors.begin(), m_boundVectors.end(), replaced), m_boundVectors.end());
+
+    m_argVersion++;
+    cl_int err = clSetKernelArg(m_kernel(), index, size, value);
+    for (size_t i = 0; i < m_deviceKernels.size() && err == CL_SUCCESS; i++)
+        err = clSetKernelArg(m_deviceKernels[i].kernel(), index, size, value);
+    arg.isSet = (err == CL_SUCCESS);
+    arg.isLocal = isLocal;
+    arg.size = size;
+    if (isLocal)
+        arg.bytes.clear();
+    else
+        arg.bytes.assign((const unsigned char*)value, (const unsigned char*)value + size);
+
+    return cl::detail::errHandler(err, "clSetKernelArg");
+}
+
+cl_int Kernel::setVectorArg(cl_uint index, cl::Buffer& buffer, bool writable, const std::shared_ptr<bool>& launched,
+    std::function<void()> upload)
+{
+    cl_int err = setArgAt(index, buffer);
+    if (err != CL_SUCCESS)
+        return err;
+
+    auto it = std::find_if(m_argTable.begin(), m_argTable.end(),
+        [index](const ArgEntry& arg) { return arg.index == index; });
+    auto sameIndex = [index](const BoundVector& b) { return b.index == index; };
+    m_boundVectors.erase(std::remove_if(m_boundVectors.begin(), m_boundVectors.end(), sameIndex), m_boundVectors.end());
+    m_boundVectors.push_back({ it != m_argTable.end() ? it->name : "", index, buffer(), writable, launched, upload });
+
+    return CL_SUCCESS;
+}
+
+// Host changes made after the vectors were bound
+void Kernel::syncVectors()
+{
+    m_boundVectors.erase(std::remove_if(m_boundVectors.begin(), m_boundVectors.end(),
+        [](const BoundVector& b) { return b.launched.expired(); }), m_boundVectors.end());
+
+    for (BoundVector &bound : m_boundVectors)
+        bound.upload();
+}
+
+void Kernel::markVectorsWritten()
+{
+    for (BoundVector &bound : m_boundVectors)
+    {
+        std::shared_ptr<bool> launched = bound.launched.lock();
+        if (launched && bound.writable)
+            *launched = true;
+    }
+}
+
+ArgSnapshot Kernel::snapshotArgs() const
+{
+    ArgSnapshot snapshot;
+    snapshot.values = m_argValues;
+    snapshot.buildId = m_buildId;
+    for (size_t i = 0; i < m_argValues.size(); i++)
+    {
+        auto it = std::find_if(m_argTable.begin(), m_argTable.end(),
+            [i](const ArgEntry& arg) { return arg.index == i; });
+        snapshot.names.push_back(it != m_argTable.end() ? it->name : "");
+    }
+
+    return snapshot;
+}
+
+// Snapshots taken before a rebuild are matched by argument name
+cl_int Kernel::restoreArgs(const ArgSnapshot& snapshot)
+{
+    const bool sameBuild = (snapshot.buildId == m_buildId);
+    for (size_t i = 0; i < snapshot.values.size(); i++)
+    {
+        const ArgValue &arg = snapshot.values[i];
+        if (!arg.isSet)
+            continue;
+
+        cl_uint index = sameBuild ? (cl_uint)i : findArg(snapshot.names[i]);
+        if (index == NO_ARG)
+            continue;
+
+        cl_int err = setArgBytes(index, arg.size, arg.isLocal ? nullptr : arg.bytes.data());
+        if (err != CL_SUCCESS)
+            return err;
+    }
+
+    return CL_SUCCESS;
+}
+
+void Kernel::unknownArg(const std::string& name) const
+{
+    std::cout << "Kernel " << m_sourcePath << " has no argument '" << name << "'" << std::endl;
+    throw std::runtime_error("Unknown kernel argument " + name);
+}
+
+void Kernel::build(cl::Context& context, std::vector<cl::Device>& devices, cl::Platform& platform, bool setArgs)
+{
+    if (devices.empty())
+        throw std::runtime_error("No devices given for building " + getFileName(m_sourcePath));
+
+    std::vector<cl::Device> extra(devices.begin() + 1, devices.end());
+    bool same = (extra.size() == m_extraDevices.size());
+    for (size_t i = 0; same && i < extra.size(); i++)
+        same = (extra[i]() == m_extraDevices[i]());
+
+    if (!same)
+    {
+        m_extraDevices = extra;
+        lastBuildOpts.clear(); // forces a rebuild
+    }
+
+    build(context, devices.front(), platform, setArgs);
 }
 
 void Kernel::rebuild(bool setArgs)
@@ -102,11 +1064,82 @@ void Kernel::rebuild(bool setArgs)
 
 bool Kernel::configHasChanged()
 {
-    std::string buildOpts = globalBuildOpts + getAdditionalBuildOptions();
-    buildOpts += " -cl-kernel-arg-info";
-    if (Kernel::CPU_DEBUG && deviceIsCPU)
-        buildOpts += " -g -s \"" + getAbsolutePath(m_sourcePath) + "\"";
-    return (buildOpts.compare(lastBuildOpts) != 0);
+    if (Kernel::HOT_RELOAD && sourcesHaveChanged())
+        return true;
+
+    // Define space redeclared since the last build
+    if (!m_defineSpace.empty() && m_defineKey.empty())
+        return true;
+
+    return (observableOptions(buildOptions(getAdditionalBuildOptions())).compare(lastBuildOpts) != 0);
+}
+
+void Kernel::linkLibrary(const std::string& path)
+{
+    if (std::find(m_libraries.begin(), m_libraries.end(), path) != m_libraries.end())
+        return;
+
+    m_libraries.push_back(path);
+    m_checkedSource.reset();
+    lastBuildOpts.clear(); // forces a rebuild
+}
+
+// Kernel sources and linked libraries, definitions used by either are observable
+SourceSummary Kernel::summarizeSources(const std::vector<std::string>& includeDirs)
+{
+    IncludeIndex &index = IncludeIndex::get(Kernel::cacheDir);
+    SourceSummary summary = index.summary(m_sourcePath, includeDirs);
+    if (m_libraries.empty())
+        return summary;
+
+    HashStream hash;
+    hash.update(summary.hash);
+    for (const std::string &lib : m_libraries)
+    {
+        SourceSummary libSummary = index.summary(lib, includeDirs);
+        hash.update(libSummary.hash);
+        summary.files.insert(summary.files.end(), libSummary.files.begin(), libSummary.files.end());
+        summary.identifiers.insert(libSummary.identifiers.begin(), libSummary.identifiers.end());
+        summary.observesAll |= libSummary.observesAll;
+    }
+    summary.hash = hash.digest();
+
+    return summary;
+}
+
+std::string Kernel::observableOptions(const std::string& buildOpts)
+{
+    return m_observesAll ? buildOpts : filterDefines(buildOpts, m_identifiers);
+}
+
+// Touched or re-saved files with identical contents do not trigger a rebuild
+bool Kernel::sourcesHaveChanged()
+{
+    if (!m_watched)
+        return false;
+
+    SourceWatcher &watcher = SourceWatcher::get();
+    watcher.poll();
+    if (!watcher.isDirty(this))
+        return false;
+
+    std::shared_ptr<SourceSummary> summary;
+    try
+    {
+        summary = std::make_shared<SourceSummary>(summarizeSources(m_includeDirs));
+    }
+    catch (std::runtime_error&)
+    {
+        return false; // file is being replaced, check again on next rebuild
+    }
+
+    watcher.clearDirty(this);
+    m_checkedSource = summary;
+    if (summary->hash == m_sourceHash)
+        return false;
+
+    std::cout << "Sources of kernel " << getFileName(m_sourcePath) << " have changed" << std::endl;
+    return true;
 }
 
 
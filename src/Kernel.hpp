@@ -3,18 +3,73 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <list>
+#include <set>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <future>
 #include "../include/cl_header.hpp"
+#include "KernelCache.hpp"
+#include "utils.hpp"
 
 // Used when inlining the kernel implementation
 #define CLT_KERNEL_IMPL(...) std::string getSource() override { return std::string(#__VA_ARGS__); }
 
 namespace clt {
 
+class Kernel;
+class LaunchSeries;
+template <typename T> class DeviceVector;
+class ProgramUse;
+struct SourceSummary;
+
+// Outcome of one kernel build, in a batch or in the background
+struct BuildResult
+{
+    Kernel* kernel = nullptr;
+    cl_int err = CL_SUCCESS;
+    std::string error = ""; // exception message, empty on success
+    std::string buildLog = "";
+    double seconds = 0.0;   // wall time spent in build()
+};
+
+// Kernel argument resolved once by name, stays valid across rebuilds
+struct ArgHandle
+{
+    cl_uint slot = (cl_uint)-1;
+    bool isValid() const { return slot != (cl_uint)-1; }
+};
+
+// Last value set for a kernel argument
+struct ArgValue
+{
+    bool isSet = false;
+    bool isLocal = false; // local memory, only the size is set
+    size_t size = 0;
+    std::vector<unsigned char> bytes;
+};
+
+// Argument values of a kernel, for switching between argument sets
+class ArgSnapshot
+{
+    friend class Kernel;
+    friend class LaunchSequence;
+    std::vector<ArgValue> values; // by argument index
+    std::vector<std::string> names;
+    unsigned buildId = 0;
+};
+
 class Kernel
 {
 public:
-    Kernel(std::string srcPath, std::string entryPoint) : m_sourcePath(srcPath), m_entryPoint(entryPoint) {};
-    ~Kernel(void) = default;
+    // Kernels register themselves for batch building
+    Kernel(std::string srcPath, std::string entryPoint);
+    virtual ~Kernel(void);
+
+    // Registered by address, cannot be copied
+    Kernel(const Kernel&) = delete;
+    Kernel& operator=(const Kernel&) = delete;
 
     explicit operator bool() const { return m_kernel() != nullptr; }
     operator cl::Kernel&() { return m_kernel; }
@@ -23,23 +78,122 @@ public:
     void build(cl::Context& context, cl::Device& device, cl::Platform& platform, bool setArgs = true);
     void rebuild(bool setArgs);
 
+    // Builds for every device of a multi-device context in one call, one cached binary
+    // per device. Arguments are set on all of them, enqueue() picks the queue's device.
+    void build(cl::Context& context, std::vector<cl::Device>& devices, cl::Platform& platform, bool setArgs = true);
+
+    // Builds all live kernels on a worker pool (zero threads: hardware concurrency)
+    // Optional callback is invoked from the worker thread as each kernel finishes
+    static std::vector<BuildResult> buildAll(cl::Context& context, cl::Device& device, cl::Platform& platform,
+        unsigned numThreads = 0, std::function<void(const BuildResult&)> onBuilt = nullptr);
+    static std::vector<BuildResult> buildAll(cl::Context& context, std::vector<cl::Device>& devices, cl::Platform& platform,
+        unsigned numThreads = 0, std::function<void(const BuildResult&)> onBuilt = nullptr);
+
+    // Compiles on a worker thread while the current kernel keeps serving launches.
+    // The new kernel is swapped in on the calling thread by the next enqueue() or
+    // applyPendingBuild(), a newer request supersedes the one in progress without
+    // waiting for it. Argument values carry over to the new kernel by name,
+    // setArgs() runs after them if requested.
+    std::shared_future<BuildResult> buildAsync(cl::Context& context, cl::Device& device, cl::Platform& platform, bool setArgs = true);
+    std::shared_future<BuildResult> rebuildAsync(bool setArgs = true);
+
+    // Installs a finished background build, true if the kernel was replaced.
+    // Needed before launching the cl::Kernel directly instead of through enqueue().
+    bool applyPendingBuild();
+    bool isBuilding() const;
+
+    // Compiles variants in the background, each given as getAdditionalBuildOptions()
+    // would return it. Finished variants are kept with the recently built ones, so
+    // that a later rebuild() to them is a swap. Needs a prior build for the device.
+    void precompileVariants(const std::vector<std::string>& additionalOpts);
+
+    template <typename... Args>
+    cl_int setArg(const std::string& name, const Args&... args)
+    {
+        cl_uint index = findArg(name);
+        if (index == NO_ARG)
+            unknownArg(name);
+        return setArgAt(index, args...);
+    }
+
+    // Launches upload host changes of the bound vector, arguments not declared
+    // const mark it device-dirty
+    template <typename T>
+    cl_int setArg(const std::string& name, DeviceVector<T>& vec)
+    {
+        cl_uint index = findArg(name);
+        if (index == NO_ARG)
+            unknownArg(name);
+        const bool writable = argIsWritable(index);
+        return setVectorArg(index, vec.bind(writable), writable, vec.m_launched, [&vec]() { vec.syncDevice(); });
+    }
+
+    template <typename T>
+    cl_int setArg(ArgHandle handle, DeviceVector<T>& vec)
+    {
+        if (handle.slot >= m_argSlots.size())
+            unknownArg("<invalid handle>");
+        const ArgSlot &slot = m_argSlots[handle.slot];
+        if (slot.index == NO_ARG)
+            unknownArg(slot.name);
+        const bool writable = argIsWritable(slot.index);
+        return setVectorArg(slot.index, vec.bind(writable), writable, vec.m_launched, [&vec]() { vec.syncDevice(); });
+    }
+
+    // Direct indexed clSetKernelArg, for arguments set every launch
     template <typename... Args>
-    cl_int setArg(const std::string name, Args... args)
+    cl_int setArg(ArgHandle handle, const Args&... args)
     {
-        auto it = argMap.find(name);
-        if (it == argMap.end())
-        {
-            std::cout << "Kernel " << m_sourcePath << " has no argument '" << name << "'" << std::endl;
-            throw std::runtime_error("Unknown kernel argument " + name);
-        }
-        else
-        {
-            return m_kernel.setArg(it->second, args...);
-        }
+        if (handle.slot >= m_argSlots.size())
+            unknownArg("<invalid handle>");
+        const ArgSlot &slot = m_argSlots[handle.slot];
+        if (slot.index == NO_ARG)
+            unknownArg(slot.name);
+        return setArgAt(slot.index, args...);
     }
 
-    bool hasArg(const std::string name) { return argMap.find(name) != argMap.end(); }
+    // Arguments are only passed to the driver when their value changes.
+    // Call after setting arguments through the cl::Kernel directly.
+    void invalidateArgs() { m_argValues.clear(); m_argVersion++; }
+
+    // Current argument values, restore() sets the ones that differ
+    ArgSnapshot snapshotArgs() const;
+    cl_int restoreArgs(const ArgSnapshot& snapshot);
+
+    // Enqueues the kernel and records its timings for the current build variant
+    // when the launch completes. Needs a queue with CL_QUEUE_PROFILING_ENABLE.
+    cl_int enqueue(cl::CommandQueue& queue, const cl::NDRange& global, const cl::NDRange& local = cl::NullRange,
+        const cl::NDRange& offset = cl::NullRange, const std::vector<cl::Event>* events = nullptr, cl::Event* event = nullptr);
+
+    // Sweeps local sizes for a representative global size and keeps the fastest one
+    // for the queue's device. The result is stored in the kernel cache next to that
+    // device's binary, enqueue() uses it for launches without an explicit local size.
+    // Launches the kernel many times.
+    cl::NDRange autotune(cl::CommandQueue& queue, const cl::NDRange& global, int repeats = 5);
+    cl::NDRange getTunedLocalSize() const { return m_tunedLocal; }
+
+    // Search space of a preprocessor definition, passed as -Dname=value.
+    // The first value is used until tuneDefines() has run for the device and configuration.
+    void declareDefine(const std::string& name, const std::vector<std::string>& values);
+
+    // Builds every combination of the declared values and times 'launch', which should
+    // enqueue representative work on queue. The fastest configuration is stored in the
+    // kernel cache per device and picked up by later builds.
+    std::map<std::string, std::string> tuneDefines(cl::CommandQueue& queue, std::function<void(Kernel&)> launch, int repeats = 3);
+
+    // Links a separately compiled library source into the kernel's program. The library
+    // holds definitions, the kernel includes a header with their declarations. Libraries
+    // are compiled once per referenced definitions and device, and cached as objects.
+    void linkLibrary(const std::string& path);
+
+    // Handles can be created before the first build, they are resolved
+    // on every build. Arguments missing from the kernel fail in setArg().
+    ArgHandle getArgHandle(const std::string& name);
+
+    bool hasArg(const std::string& name) { return findArg(name) != NO_ARG; }
     std::string getBuildLog() { return m_buildLog; }
+    std::string getSourcePath() { return m_sourcePath; }
+    std::string getEntryPoint() { return m_entryPoint; }
 
     // For accessing compilation settings and device buffers
     static void setUserPointer(void* p) { Kernel::userPtr = p; }
@@ -47,14 +201,61 @@ public:
     
     // Kernel cache directory
     static void setCacheDir(std::string s) { Kernel::cacheDir = s; }
+    static void setCacheFormat(CacheFormat f) { Kernel::cacheFormat = f; }
+    static KernelCache& getCache() { return KernelCache::get(Kernel::cacheDir, Kernel::cacheFormat); }
 
     // Flag that enables CPU debugging on Intel processors
     static void setCpuDebug(bool v) { Kernel::CPU_DEBUG = v; }
     static bool isCpuDebug() { return Kernel::CPU_DEBUG; }
 
+    // Makes rebuild() recompile kernels whose sources or includes were edited
+    static void setHotReload(bool v) { Kernel::HOT_RELOAD = v; }
+    static bool isHotReload() { return Kernel::HOT_RELOAD; }
+
+    // Number of built variants (program, kernel, argument names) kept per kernel
+    static void setVariantCacheSize(size_t n) { Kernel::variantCacheSize = n; }
+
 private:
+    friend class LaunchSequence;
+
+    static std::vector<BuildResult> buildRegistered(std::function<void(Kernel&)> build, unsigned numThreads,
+        std::function<void(const BuildResult&)> onBuilt);
+
     // For checking if recompilation is necessary
     bool configHasChanged();
+    bool sourcesHaveChanged();
+    std::string defineOptions();
+    std::string observableOptions(const std::string& buildOpts);
+    std::string buildOptions(const std::string& additionalOpts);
+    SourceSummary summarizeSources(const std::vector<std::string>& includeDirs);
+    std::string defineCacheKey();
+    void loadTunedDefines();
+
+    // Builds are split so that compilation can run without touching the kernel
+    struct BuildProducts;
+    std::shared_ptr<BuildProducts> prepareBuild(cl::Context& context, cl::Device& device, cl::Platform& platform,
+        const std::string& additionalOpts);
+    static void compileBuild(BuildProducts& products);
+
+    // Kernel built for one device of the context
+    struct DeviceKernel
+    {
+        cl::Device device;
+        cl::Kernel kernel;
+        std::shared_ptr<ProgramUse> programUse; // keeps the shared program cached
+        std::string cacheKey = "";
+        cl::NDRange tunedLocal;
+    };
+
+    static void compileForDevice(const BuildProducts& products, cl::Device& device, DeviceKernel& out, std::string& buildLog);
+    void selectKernel(cl::CommandQueue& queue, cl::Kernel*& kernel, cl::NDRange*& tunedLocal);
+    void installBuild(std::shared_ptr<BuildProducts> products, bool setArgs);
+    std::shared_future<BuildResult> startBuild(std::shared_ptr<BuildProducts> products);
+    void waitPendingBuild();
+
+    static std::string variantKey(const BuildProducts& products);
+    std::shared_ptr<BuildProducts> findVariant(const BuildProducts& products);
+    void storeVariant(std::shared_ptr<BuildProducts> products);
     
     // Cached for recompilation
     cl::Context* context;
@@ -64,13 +265,98 @@ private:
 
     static std::string globalBuildOpts;
     static std::string cacheDir;
+    static CacheFormat cacheFormat;
     static bool CPU_DEBUG;
+    static bool HOT_RELOAD;
+    static size_t variantCacheSize;
     std::string m_sourcePath = ""; // path to kernel source file
     std::string m_entryPoint = ""; // name of main function in kernel
     cl::Kernel m_kernel;
-    std::string lastBuildOpts; // for detecting need to recompile
-    std::map<std::string, cl_uint> argMap;
+    std::string lastBuildOpts; // for detecting need to recompile, unreferenced defines removed
+
+    // Argument names of the built kernel, scanned by hash
+    struct ArgEntry
+    {
+        size_t hash;
+        std::string name;
+        cl_uint index;
+        bool isConst; // pointee declared const
+    };
+
+    // Target of an ArgHandle, index re-resolved on every build
+    struct ArgSlot
+    {
+        std::string name;
+        cl_uint index;
+    };
+
+    template <typename T>
+    cl_int setArgAt(cl_uint index, const T& value)
+    {
+        typedef cl::detail::KernelArgumentHandler<T> Handler;
+        return setArgBytes(index, Handler::size(value), Handler::ptr(value));
+    }
+
+    cl_int setArgAt(cl_uint index, size_t size, const void* value) { return setArgBytes(index, size, value); }
+    cl_int setArgBytes(cl_uint index, size_t size, const void* value);
+    cl_int setVectorArg(cl_uint index, cl::Buffer& buffer, bool writable, const std::shared_ptr<bool>& launched,
+        std::function<void()> upload);
+    void syncVectors();
+    void markVectorsWritten();
+
+    static const cl_uint NO_ARG = (cl_uint)-1;
+    cl_uint findArg(const std::string& name) const;
+    bool argIsWritable(cl_uint index) const;
+    [[noreturn]] void unknownArg(const std::string& name) const;
+
+    std::vector<ArgEntry> m_argTable;
+    std::vector<ArgSlot> m_argSlots;
+    std::vector<ArgValue> m_argValues; // shadow of the driver state, by index
+
+    // DeviceVector bound to an argument, synced before and flagged after every launch
+    struct BoundVector
+    {
+        std::string name; // for re-resolving after builds
+        cl_uint index;
+        cl_mem buffer;
+        bool writable;
+        std::weak_ptr<bool> launched; // expires with the vector
+        std::function<void()> upload;
+    };
+
+    std::vector<BoundVector> m_boundVectors;
+    unsigned m_buildId = 0;
+    unsigned m_argVersion = 0;               // changed by every driver-side argument update
+    std::shared_ptr<LaunchSeries> m_timings; // of the current variant
+    std::string m_cacheKey = "";             // of the current binary, empty if not cached
+    cl::NDRange m_tunedLocal;                // NullRange if not tuned
+
+    std::vector<std::pair<std::string, std::vector<std::string>>> m_defineSpace;
+    std::map<std::string, std::string> m_defineValues; // used in builds
+    std::string m_defineKey = "";                       // of the loaded values
     std::string m_buildLog = ""; // last build log
+    Hash128 m_sourceHash; // include tree hash at last build
+    std::vector<std::string> m_includeDirs; // -I paths of the last build
+    std::shared_ptr<SourceSummary> m_checkedSource; // of the last change check, reused by the next build
+    std::set<std::string> m_identifiers;    // referenced by the sources at the last build
+    bool m_observesAll = false;
+    bool m_watched = false;  // registered with SourceWatcher
+    std::vector<std::string> m_libraries; // linked into the program
+    std::vector<cl::Device> m_extraDevices;     // built for besides device
+    std::vector<DeviceKernel> m_deviceKernels;  // by m_extraDevices
+    std::shared_ptr<BuildProducts> m_pending;        // newest background build
+    std::shared_future<BuildResult> m_pendingResult;
+    bool m_pendingSetArgs = true;
+
+    struct PendingVariant
+    {
+        std::shared_ptr<BuildProducts> products;
+        std::shared_future<BuildResult> result;
+    };
+
+    std::shared_ptr<BuildProducts> m_current;            // installed build
+    std::list<std::shared_ptr<BuildProducts>> m_variants; // recently built, most recent first
+    std::vector<PendingVariant> m_precompiling;
 
 protected:
     virtual std::string getAdditionalBuildOptions() { return ""; };
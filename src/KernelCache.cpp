@@ -0,0 +1,778 @@
+#include "KernelCache.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
+#include <random>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace clt {
+
+MappedFile::MappedFile(const std::string& path)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    m_file = file;
+    m_size = (size_t)size.QuadPart;
+    m_opened = true;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_mapping)
+        m_data = (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    m_opened = (m_data != nullptr);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        m_size = (size_t)st.st_size;
+        m_opened = true;
+        if (m_size > 0)
+        {
+            void* ptr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            m_data = (ptr == MAP_FAILED) ? nullptr : (const unsigned char*)ptr;
+            m_opened = (m_data != nullptr);
+        }
+    }
+
+    // Mapping stays valid after closing the descriptor
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile(void)
+{
+#if defined(_WIN32)
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle((HANDLE)m_mapping);
+    if (m_file)
+        CloseHandle((HANDLE)m_file);
+#else
+    if (m_data)
+        munmap((void*)m_data, m_size);
+#endif
+}
+
+unsigned long long KernelCache::s_maxBytes = 0;
+size_t KernelCache::s_maxEntries = 0;
+
+static const char* MANIFEST_HEADER = "CLT-CACHE-MANIFEST 1";
+
+FileLock::FileLock(const std::string& path, bool wait)
+{
+#if defined(_WIN32)
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+
+    OVERLAPPED ov = {};
+    m_handle = h;
+    m_locked = LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, MAXDWORD, MAXDWORD, &ov) != 0;
+#else
+    while (true)
+    {
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            return;
+
+        // Locks belong to the open file description, so threads exclude each other too
+        int ret;
+        do { ret = flock(m_fd, LOCK_EX | (wait ? 0 : LOCK_NB)); } while (ret != 0 && errno == EINTR);
+        m_locked = (ret == 0);
+        if (!m_locked)
+            break;
+
+        // The file may have been removed while we waited, its lock no longer excludes anyone
+        struct stat held, current;
+        if (fstat(m_fd, &held) == 0 && stat(path.c_str(), &current) == 0 && held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+            break;
+
+        close(m_fd);
+        m_fd = -1;
+        m_locked = false;
+    }
+#endif
+    if (!m_locked && wait)
+        std::cout << "Could not lock " << path << std::endl;
+}
+
+FileLock::~FileLock(void)
+{
+#if defined(_WIN32)
+    if (m_handle)
+    {
+        if (m_locked)
+        {
+            OVERLAPPED ov = {};
+            UnlockFileEx((HANDLE)m_handle, 0, MAXDWORD, MAXDWORD, &ov);
+        }
+        CloseHandle((HANDLE)m_handle);
+    }
+#else
+    if (m_fd >= 0)
+        close(m_fd); // releases the lock
+#endif
+}
+
+KernelCache& KernelCache::get(const std::string& cacheDir, CacheFormat format)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<std::string, CacheFormat>, std::unique_ptr<KernelCache>> caches;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<KernelCache> &cache = caches[std::make_pair(cacheDir, format)];
+    if (!cache)
+    {
+        if (format == CacheFormat::Pack)
+            cache.reset(new PackCache(cacheDir));
+        else
+            cache.reset(new FileCache(cacheDir));
+    }
+
+    return *cache;
+}
+
+void KernelCache::setLimits(unsigned long long maxBytes, size_t maxEntries)
+{
+    s_maxBytes = maxBytes;
+    s_maxEntries = maxEntries;
+}
+
+KernelCache::KernelCache(const std::string& dir, const std::string& manifestName) : m_dir(dir), m_manifestPath(dir + "/" + manifestName)
+{
+    loadManifest();
+}
+
+// Hit counts and use times are written when the process exits
+KernelCache::~KernelCache(void)
+{
+    flush();
+}
+
+bool KernelCache::find(const std::string& key, BinaryView& view)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!findBinary(key, view))
+        return false;
+
+    CacheEntry &e = m_entries[key];
+    e.size = view.size;
+    e.lastUse = (long long)std::time(nullptr);
+    e.hits++;
+    m_manifestDirty = true;
+
+    return true;
+}
+
+bool KernelCache::store(const std::string& key, const void* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!storeBinary(key, data, size))
+        return false;
+
+    CacheEntry &e = m_entries[key];
+    e.size = size;
+    e.lastUse = (long long)std::time(nullptr);
+    e.hits = 0;
+    m_removed.erase(key);
+    m_manifestDirty = true;
+
+    if (s_maxBytes > 0 || s_maxEntries > 0)
+        evict(s_maxBytes, s_maxEntries, 0, key);
+
+    saveManifest();
+    return true;
+}
+
+bool KernelCache::remove(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.erase(key);
+    m_removed.insert(key);
+    m_manifestDirty = true;
+    return removeBinary(key);
+}
+
+std::unique_ptr<FileLock> KernelCache::lockEntry(const std::string& key)
+{
+    const std::string lockDir = m_dir + "/locks";
+    createDirectory(lockDir);
+    return std::unique_ptr<FileLock>(new FileLock(lockDir + "/" + key + ".lock"));
+}
+
+size_t KernelCache::collect(unsigned long long maxBytes, size_t maxEntries, long long maxAge)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Adopt binaries written before the manifest existed, drop entries that are gone
+    std::map<std::string, CacheEntry> current = scanLocked();
+    for (const auto &it : m_entries)
+    {
+        if (current.count(it.first) == 0)
+            m_removed.insert(it.first);
+    }
+    m_entries.swap(current);
+
+    m_manifestDirty = true;
+    size_t evicted = evict(maxBytes, maxEntries, maxAge, "");
+    saveManifest();
+    removeStaleLocks();
+
+    return evicted;
+}
+
+// Lock files of keys without a binary, skipped while held (being built).
+// Waiters on a removed file notice the missing path and lock the new one.
+// Windows cannot tell a deleted file from a live one by handle, locks stay there.
+// Caller holds m_mutex.
+void KernelCache::removeStaleLocks()
+{
+#ifndef _WIN32
+    const std::string lockDir = m_dir + "/locks";
+    for (const std::string &name : listDirectory(lockDir))
+    {
+        if (!endsWith(name, ".lock") || m_entries.count(name.substr(0, name.length() - 5)))
+            continue;
+
+        const std::string path = lockDir + "/" + name;
+        FileLock lock(path, false);
+        if (lock.isLocked())
+            std::remove(path.c_str());
+    }
+#endif
+}
+
+std::map<std::string, CacheEntry> KernelCache::scan()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return scanLocked();
+}
+
+// Caller holds m_mutex
+std::map<std::string, CacheEntry> KernelCache::scanLocked()
+{
+    std::map<std::string, CacheEntry> binaries = listBinaries();
+    for (auto &b : binaries)
+    {
+        auto it = m_entries.find(b.first);
+        if (it == m_entries.end())
+            continue;
+        b.second.lastUse = it->second.lastUse;
+        b.second.hits = it->second.hits;
+    }
+
+    return binaries;
+}
+
+// Caller holds m_mutex
+size_t KernelCache::evict(unsigned long long maxBytes, size_t maxEntries, long long maxAge, const std::string& keep)
+{
+    // Oldest first
+    std::vector<std::pair<long long, std::string>> order;
+    unsigned long long bytes = 0;
+    for (const auto &it : m_entries)
+    {
+        order.push_back(std::make_pair(it.second.lastUse, it.first));
+        bytes += it.second.size;
+    }
+    std::sort(order.begin(), order.end());
+
+    const long long now = (long long)std::time(nullptr);
+    size_t entries = m_entries.size();
+    size_t evicted = 0;
+
+    for (const auto &o : order)
+    {
+        const bool stale = maxAge > 0 && now - o.first > maxAge;
+        const bool overBudget = (maxBytes > 0 && bytes > maxBytes) || (maxEntries > 0 && entries > maxEntries);
+        if (!stale && !overBudget)
+            continue;
+        if (o.second == keep)
+            continue;
+
+        bytes -= m_entries[o.second].size;
+        entries--;
+        m_entries.erase(o.second);
+        m_removed.insert(o.second);
+        removeBinary(o.second);
+        evicted++;
+    }
+
+    if (evicted > 0)
+    {
+        std::cout << "Evicted " << evicted << " kernel binaries from " << m_dir << std::endl;
+        m_manifestDirty = true;
+    }
+
+    return evicted;
+}
+
+std::map<std::string, CacheEntry> KernelCache::entries()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries;
+}
+
+unsigned long long KernelCache::totalBytes()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned long long bytes = 0;
+    for (const auto &it : m_entries)
+        bytes += it.second.size;
+    return bytes;
+}
+
+void KernelCache::flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    saveManifest();
+}
+
+// Format: header, then "size lastUse hits key" per entry
+static std::map<std::string, CacheEntry> readManifest(const std::string& path)
+{
+    std::map<std::string, CacheEntry> entries;
+
+    std::ifstream f(path);
+    std::string line;
+    if (!f || !getline(f, line) || line != MANIFEST_HEADER)
+        return entries;
+
+    while (getline(f, line))
+    {
+        std::istringstream ss(line);
+        CacheEntry e;
+        if (!(ss >> e.size >> e.lastUse >> e.hits))
+            break;
+
+        std::string key;
+        ss.get(); // separator
+        getline(ss, key);
+        entries[key] = e;
+    }
+
+    return entries;
+}
+
+void KernelCache::loadManifest()
+{
+    m_entries = readManifest(m_manifestPath);
+    m_loaded = m_entries;
+}
+
+// Other processes update the same manifest: merge with the version on disk
+// under a lock and publish atomically
+void KernelCache::saveManifest()
+{
+    if (!m_manifestDirty)
+        return;
+
+    long long size, mtime;
+    if (!getFileStat(m_dir, size, mtime))
+        return; // cache directory not created yet
+
+    FileLock lock(m_manifestPath + ".lock");
+    std::map<std::string, CacheEntry> merged = readManifest(m_manifestPath);
+
+    for (const std::string &key : m_removed)
+        merged.erase(key);
+
+    for (const auto &it : m_entries)
+    {
+        auto disk = merged.find(it.first);
+        if (disk == merged.end())
+        {
+            merged[it.first] = it.second;
+            continue;
+        }
+
+        // Add the hits made by this process since the manifest was last read
+        auto loaded = m_loaded.find(it.first);
+        unsigned long long baseHits = (loaded != m_loaded.end() && loaded->second.hits <= it.second.hits) ? loaded->second.hits : 0;
+        disk->second.hits += it.second.hits - baseHits;
+        disk->second.lastUse = std::max(disk->second.lastUse, it.second.lastUse);
+        disk->second.size = it.second.size;
+    }
+
+    const std::string tmpPath = tempFilePath(m_manifestPath);
+    {
+        std::ofstream f(tmpPath, std::ofstream::out | std::ofstream::trunc);
+        if (!f)
+            return;
+
+        f << MANIFEST_HEADER << "\n";
+        for (const auto &it : merged)
+            f << it.second.size << " " << it.second.lastUse << " " << it.second.hits << " " << it.first << "\n";
+
+        if (!f.good())
+        {
+            f.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+
+    if (!replaceFile(tmpPath, m_manifestPath))
+    {
+        std::remove(tmpPath.c_str());
+        return;
+    }
+
+    m_entries = merged;
+    m_loaded = merged;
+    m_removed.clear();
+    m_manifestDirty = false;
+}
+
+
+/* FileCache */
+
+std::string FileCache::location(const std::string& key)
+{
+    return m_dir + "/" + key + ".bin";
+}
+
+bool FileCache::findBinary(const std::string& key, BinaryView& view)
+{
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(location(key));
+    if (!mapping->isValid() || mapping->size() == 0)
+        return false;
+
+    view.mapping = mapping;
+    view.data = mapping->data();
+    view.size = mapping->size();
+    return true;
+}
+
+bool FileCache::storeBinary(const std::string& key, const void* data, size_t size)
+{
+    const std::string binaryPath = location(key);
+    const std::string tmpPath = tempFilePath(binaryPath);
+
+    // Written to a temporary file first, readers never see partial binaries
+    std::ofstream stream;
+    stream.open(tmpPath, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+    if (!stream.good())
+    {
+        std::cout << "Failed to open kernel binary output file " << tmpPath << std::endl;
+        return false;
+    }
+
+    stream.write((const char*)data, size);
+    stream.close();
+
+    // Check write
+    if (!stream.good() || !replaceFile(tmpPath, binaryPath))
+    {
+        std::cout << "Failed to write kernel binary " << binaryPath << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool FileCache::removeBinary(const std::string& key)
+{
+    return std::remove(location(key).c_str()) == 0;
+}
+
+std::map<std::string, CacheEntry> FileCache::listBinaries()
+{
+    std::map<std::string, CacheEntry> binaries;
+    for (const std::string &name : listDirectory(m_dir))
+    {
+        if (!endsWith(name, ".bin"))
+            continue;
+
+        long long size, mtime;
+        if (getFileStat(m_dir + "/" + name, size, mtime))
+        {
+            CacheEntry &e = binaries[name.substr(0, name.length() - 4)];
+            e.size = (unsigned long long)size;
+            e.lastUse = mtime / 1000000000LL; // ns
+        }
+    }
+
+    return binaries;
+}
+
+
+/* PackCache */
+
+static const char PACK_MAGIC[8] = { 'C', 'L', 'T', 'P', 'A', 'C', 'K', '2' };
+static const uint32_t RECORD_MAGIC = 0x44434552; // "RECD"
+
+// Magic followed by a random id that changes whenever the pack is rewritten
+static const size_t PACK_HEADER_SIZE = sizeof(PACK_MAGIC) + sizeof(uint64_t);
+
+// Followed by the key and the binary, no binary marks a removal
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t keyLength;
+    uint64_t dataSize;
+};
+
+static bool writePackHeader(FILE* f)
+{
+    std::random_device rd;
+    uint64_t id = ((uint64_t)rd() << 32) ^ (uint64_t)rd() ^ (uint64_t)std::time(nullptr);
+    return fwrite(PACK_MAGIC, sizeof(PACK_MAGIC), 1, f) == 1 && fwrite(&id, sizeof(id), 1, f) == 1;
+}
+
+PackCache::PackCache(const std::string& dir) : KernelCache(dir, "kernels.pack.manifest"), m_packPath(dir + "/kernels.pack"), m_lockPath(dir + "/kernels.pack.lock")
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refresh();
+}
+
+std::string PackCache::location(const std::string& key)
+{
+    return m_packPath + ":" + key;
+}
+
+bool PackCache::refresh()
+{
+    long long fileSize = 0, mtime = 0;
+    if (!getFileStat(m_packPath, fileSize, mtime) || (size_t)fileSize == m_indexedBytes)
+        return true;
+
+    // Also covers empty files, which cannot be mapped
+    if ((size_t)fileSize < PACK_HEADER_SIZE)
+    {
+        m_index.clear();
+        m_indexedBytes = 0;
+        return true;
+    }
+
+    // Views handed out earlier keep the old mapping alive
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(m_packPath);
+    if (!mapping->isValid())
+        return false;
+
+    const unsigned char* base = mapping->data();
+    const size_t size = mapping->size();
+
+    if (size < PACK_HEADER_SIZE || memcmp(base, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0)
+    {
+        std::cout << "Ignoring invalid kernel pack " << m_packPath << std::endl;
+        m_index.clear();
+        m_indexedBytes = 0;
+        return true;
+    }
+
+    // Pack was compacted or recreated by someone else, index from scratch
+    uint64_t id;
+    memcpy(&id, base + sizeof(PACK_MAGIC), sizeof(id));
+    if (id != m_packId || size < m_indexedBytes)
+    {
+        m_index.clear();
+        m_indexedBytes = 0;
+        m_packId = id;
+    }
+
+    size_t pos = std::max(m_indexedBytes, PACK_HEADER_SIZE);
+
+    // Tail that is being written (or was interrupted) is left unindexed
+    while (pos + sizeof(RecordHeader) <= size)
+    {
+        RecordHeader hdr;
+        memcpy(&hdr, base + pos, sizeof(hdr));
+        const size_t recordSize = sizeof(hdr) + hdr.keyLength + (size_t)hdr.dataSize;
+        if (hdr.magic != RECORD_MAGIC || pos + recordSize > size)
+            break;
+
+        const std::string key((const char*)base + pos + sizeof(hdr), hdr.keyLength);
+        if (hdr.dataSize == 0)
+        {
+            m_index.erase(key);
+        }
+        else
+        {
+            Entry &e = m_index[key];
+            e.offset = pos + sizeof(hdr) + hdr.keyLength;
+            e.size = (size_t)hdr.dataSize;
+        }
+
+        pos += recordSize;
+    }
+
+    m_mapping = mapping;
+    m_indexedBytes = pos;
+    return true;
+}
+
+bool PackCache::findBinary(const std::string& key, BinaryView& view)
+{
+    auto it = m_index.find(key);
+    if (it == m_index.end())
+    {
+        // Might have been appended since the pack was mapped
+        refresh();
+        it = m_index.find(key);
+        if (it == m_index.end())
+            return false;
+    }
+
+    view.mapping = m_mapping;
+    view.data = m_mapping->data() + it->second.offset;
+    view.size = it->second.size;
+    return true;
+}
+
+bool PackCache::storeBinary(const std::string& key, const void* data, size_t size)
+{
+    if (!appendRecord(key, data, size))
+    {
+        std::cout << "Failed to write kernel binary to pack " << m_packPath << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool PackCache::removeBinary(const std::string& key)
+{
+    if (m_index.count(key) == 0 || !appendRecord(key, nullptr, 0))
+        return false;
+
+    // Rewrite once more than half of the pack is dead
+    size_t liveBytes = PACK_HEADER_SIZE;
+    for (const auto &it : m_index)
+        liveBytes += sizeof(RecordHeader) + it.first.size() + it.second.size;
+    if (liveBytes < m_indexedBytes / 2)
+        compact();
+
+    return true;
+}
+
+// Records carry no time, they are dated by the last write of the pack
+std::map<std::string, CacheEntry> PackCache::listBinaries()
+{
+    refresh();
+
+    long long packSize = 0, mtime = 0;
+    getFileStat(m_packPath, packSize, mtime);
+
+    std::map<std::string, CacheEntry> binaries;
+    for (const auto &it : m_index)
+    {
+        CacheEntry &e = binaries[it.first];
+        e.size = it.second.size;
+        e.lastUse = mtime / 1000000000LL; // ns
+    }
+
+    return binaries;
+}
+
+bool PackCache::appendRecord(const std::string& key, const void* data, size_t size)
+{
+    // Only one writer at a time, across processes
+    FileLock lock(m_lockPath);
+    if (!refresh())
+        return false;
+
+    // Nobody else is writing: unindexed bytes are an interrupted record, cut them off.
+    // Only a pack without a readable header is started anew.
+    long long fileSize = 0, mtime = 0;
+    if (getFileStat(m_packPath, fileSize, mtime) && (size_t)fileSize != m_indexedBytes)
+    {
+        if (m_indexedBytes == 0)
+        {
+            std::cout << "Kernel pack " << m_packPath << " is damaged, recreating" << std::endl;
+            std::remove(m_packPath.c_str());
+        }
+        else if (!truncateFile(m_packPath, (long long)m_indexedBytes))
+        {
+            return false;
+        }
+    }
+
+    FILE* f = fopen(m_packPath.c_str(), "ab");
+    if (!f)
+        return false;
+
+    bool ok = true;
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0)
+        ok &= writePackHeader(f);
+
+    RecordHeader hdr;
+    hdr.magic = RECORD_MAGIC;
+    hdr.keyLength = (uint32_t)key.size();
+    hdr.dataSize = (uint64_t)size;
+    ok &= fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    ok &= fwrite(key.data(), 1, key.size(), f) == key.size();
+    if (size > 0)
+        ok &= fwrite(data, 1, size, f) == size;
+    ok &= fclose(f) == 0;
+
+    refresh();
+    return ok;
+}
+
+// Writes live records to a new pack that replaces the old one
+void PackCache::compact()
+{
+    FileLock lock(m_lockPath);
+    refresh();
+
+    const std::string tmpPath = tempFilePath(m_packPath);
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f)
+        return;
+
+    bool ok = writePackHeader(f);
+    for (const auto &it : m_index)
+    {
+        RecordHeader hdr;
+        hdr.magic = RECORD_MAGIC;
+        hdr.keyLength = (uint32_t)it.first.size();
+        hdr.dataSize = (uint64_t)it.second.size;
+        ok &= fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+        ok &= fwrite(it.first.data(), 1, it.first.size(), f) == it.first.size();
+        ok &= fwrite(m_mapping->data() + it.second.offset, 1, it.second.size, f) == it.second.size;
+    }
+    ok &= fclose(f) == 0;
+
+    if (!ok || !replaceFile(tmpPath, m_packPath))
+    {
+        std::remove(tmpPath.c_str());
+        return;
+    }
+
+    refresh();
+}
+
+} // end namespace clt
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <set>
+
+namespace clt {
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile(void);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isValid() const { return m_opened; }
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const unsigned char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_opened = false;
+#ifdef _WIN32
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
+
+// Advisory exclusive lock on a file, shared between threads and processes.
+// Blocks until acquired unless wait is false, released on destruction.
+class FileLock
+{
+public:
+    explicit FileLock(const std::string& path, bool wait = true);
+    ~FileLock(void);
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    bool isLocked() const { return m_locked; }
+
+private:
+    bool m_locked = false;
+#ifdef _WIN32
+    void* m_handle = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
+
+// Cached binary, keeps its mapping alive while in use
+struct BinaryView
+{
+    std::shared_ptr<MappedFile> mapping;
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+};
+
+enum class CacheFormat
+{
+    Files, // one <key>.bin file per binary
+    Pack   // single indexed, memory-mapped pack file
+};
+
+// Manifest record of a cached binary
+struct CacheEntry
+{
+    unsigned long long size = 0;
+    long long lastUse = 0; // unix time
+    unsigned long long hits = 0;
+};
+
+// Storage backend for compiled kernel binaries.
+// Usage of every entry is tracked in a manifest in the cache directory,
+// least recently used entries are evicted when a budget is set.
+class KernelCache
+{
+public:
+    virtual ~KernelCache(void);
+
+    // Process-wide cache for a directory
+    static KernelCache& get(const std::string& cacheDir, CacheFormat format);
+
+    // Budget enforced after each store, zero means unlimited
+    static void setLimits(unsigned long long maxBytes, size_t maxEntries);
+
+    bool find(const std::string& key, BinaryView& view);
+    bool store(const std::string& key, const void* data, size_t size);
+    bool remove(const std::string& key);
+
+    // Serializes producers of an entry across processes: one compiles,
+    // the others wait and then find the published binary
+    std::unique_ptr<FileLock> lockEntry(const std::string& key);
+
+    // Evicts entries unused for maxAge seconds, then least recently used ones
+    // until the budget is met (zero: no limit). Also picks up binaries missing
+    // from the manifest and removes lock files of keys without a binary.
+    // Returns the number of evicted entries.
+    size_t collect(unsigned long long maxBytes, size_t maxEntries, long long maxAge);
+
+    // Entries as collect() would see them, without changing the manifest.
+    // Binaries missing from it are dated by their file time.
+    std::map<std::string, CacheEntry> scan();
+
+    std::map<std::string, CacheEntry> entries();
+    unsigned long long totalBytes();
+
+    // Writes the manifest if it has changed
+    void flush();
+
+    // Human readable location of an entry, for logging
+    virtual std::string location(const std::string& key) = 0;
+
+    const std::string& directory() const { return m_dir; }
+
+protected:
+    KernelCache(const std::string& dir, const std::string& manifestName);
+
+    // Backend operations, called with m_mutex held
+    virtual bool findBinary(const std::string& key, BinaryView& view) = 0;
+    virtual bool storeBinary(const std::string& key, const void* data, size_t size) = 0;
+    virtual bool removeBinary(const std::string& key) = 0;
+    // Stored binaries with their size and file time as lastUse
+    virtual std::map<std::string, CacheEntry> listBinaries() = 0;
+
+    std::string m_dir;
+    std::mutex m_mutex;
+
+private:
+    void loadManifest();
+    void saveManifest();
+    std::map<std::string, CacheEntry> scanLocked();
+    void removeStaleLocks();
+    size_t evict(unsigned long long maxBytes, size_t maxEntries, long long maxAge, const std::string& keep);
+
+    static unsigned long long s_maxBytes;
+    static size_t s_maxEntries;
+
+    std::string m_manifestPath;
+    std::map<std::string, CacheEntry> m_entries;
+    std::map<std::string, CacheEntry> m_loaded; // as last read from disk
+    std::set<std::string> m_removed;            // evicted by this process
+    bool m_manifestDirty = false;
+};
+
+// Binaries stored as <cacheDir>/<key>.bin
+class FileCache : public KernelCache
+{
+public:
+    explicit FileCache(const std::string& dir) : KernelCache(dir, "manifest.txt") {}
+    std::string location(const std::string& key) override;
+
+protected:
+    bool findBinary(const std::string& key, BinaryView& view) override;
+    bool storeBinary(const std::string& key, const void* data, size_t size) override;
+    bool removeBinary(const std::string& key) override;
+    std::map<std::string, CacheEntry> listBinaries() override;
+};
+
+// All binaries appended to <cacheDir>/kernels.pack, which is mapped once.
+// Writers hold a lock on the pack, readers never block.
+// Entries are found through an in-memory index built when the pack is mapped,
+// later records replace earlier ones with the same key and empty records
+// mark removals. The pack is compacted once most of it is dead.
+class PackCache : public KernelCache
+{
+public:
+    explicit PackCache(const std::string& dir);
+    std::string location(const std::string& key) override;
+
+protected:
+    bool findBinary(const std::string& key, BinaryView& view) override;
+    bool storeBinary(const std::string& key, const void* data, size_t size) override;
+    bool removeBinary(const std::string& key) override;
+    std::map<std::string, CacheEntry> listBinaries() override;
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    // Maps the pack again if it has grown, indexes new records. False if the
+    // pack could not be mapped, which says nothing about its contents.
+    bool refresh();
+    bool appendRecord(const std::string& key, const void* data, size_t size);
+    void compact();
+
+    std::string m_packPath;
+    std::string m_lockPath;
+    unsigned long long m_packId = 0; // detects packs replaced by other processes
+    std::shared_ptr<MappedFile> m_mapping;
+    std::unordered_map<std::string, Entry> m_index;
+    size_t m_indexedBytes = 0;
+};
+
+} // end namespace clt
@@ -0,0 +1,183 @@
+#include "KernelStats.hpp"
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+
+namespace clt {
+
+void LaunchSeries::add(unsigned long long queued, unsigned long long submit, unsigned long long start, unsigned long long end)
+{
+    // Some drivers report equal or out of order timestamps for short commands
+    submit = std::max(submit, queued);
+    start = std::max(start, submit);
+    end = std::max(end, start);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    addSample(m_queued, submit - queued);
+    addSample(m_submit, start - submit);
+    addSample(m_execute, end - start);
+}
+
+void LaunchSeries::addSample(Phase& phase, unsigned long long ns)
+{
+    phase.min = (phase.count == 0) ? ns : std::min(phase.min, ns);
+    phase.sum += (double)ns;
+
+    if (phase.recent.size() < WINDOW)
+        phase.recent.push_back(ns);
+    else
+        phase.recent[phase.count % WINDOW] = ns;
+
+    phase.count++;
+}
+
+void LaunchSeries::summarize(KernelTimings& timings)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    summarize(m_queued, timings.queued);
+    summarize(m_submit, timings.submit);
+    summarize(m_execute, timings.execute);
+}
+
+void LaunchSeries::summarize(Phase& phase, PhaseStats& stats)
+{
+    stats = PhaseStats();
+    stats.count = phase.count;
+    if (phase.count == 0)
+        return;
+
+    const double toMs = 1e-6;
+    stats.min = phase.min * toMs;
+    stats.mean = phase.sum / phase.count * toMs;
+
+    std::vector<unsigned long long> sorted = phase.recent;
+    std::sort(sorted.begin(), sorted.end());
+    stats.p50 = sorted[(sorted.size() - 1) / 2] * toMs;
+    stats.p99 = sorted[(sorted.size() - 1) * 99 / 100] * toMs;
+}
+
+// Never destroyed: driver callbacks of launches in flight may arrive during exit
+KernelStats& KernelStats::get()
+{
+    static KernelStats* stats = new KernelStats();
+    return *stats;
+}
+
+std::shared_ptr<LaunchSeries> KernelStats::series(const std::string& kernel, const std::string& variant)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::shared_ptr<LaunchSeries> &s = m_series[std::make_pair(kernel, variant)];
+    if (!s)
+        s = std::make_shared<LaunchSeries>();
+    return s;
+}
+
+std::vector<KernelTimings> KernelStats::summary()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<KernelTimings> result;
+    for (auto &it : m_series)
+    {
+        KernelTimings timings;
+        timings.kernel = it.first.first;
+        timings.variant = it.first.second;
+        it.second->summarize(timings);
+        if (timings.execute.count > 0)
+            result.push_back(timings);
+    }
+
+    return result;
+}
+
+// Launches in flight keep recording into the series they started with
+void KernelStats::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_series.clear();
+}
+
+void KernelStats::beginLaunch()
+{
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    m_pending++;
+}
+
+void KernelStats::endLaunch()
+{
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    if (m_pending > 0 && --m_pending == 0)
+        m_pendingDone.notify_all();
+}
+
+bool KernelStats::flush(unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(m_pendingMutex);
+    return m_pendingDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return m_pending == 0; });
+}
+
+std::string KernelStats::table()
+{
+    std::ostringstream out;
+    out << std::left << std::setw(32) << "Kernel" << std::setw(24) << "Variant"
+        << std::right << std::setw(8) << "Count"
+        << std::setw(10) << "Min" << std::setw(10) << "Mean" << std::setw(10) << "P50" << std::setw(10) << "P99"
+        << std::setw(12) << "Queued" << std::setw(12) << "Submit" << " (ms)" << std::endl;
+
+    out << std::fixed << std::setprecision(3);
+    for (const KernelTimings &t : summary())
+    {
+        out << std::left << std::setw(32) << t.kernel << std::setw(24) << (t.variant.empty() ? "-" : t.variant)
+            << std::right << std::setw(8) << t.execute.count
+            << std::setw(10) << t.execute.min << std::setw(10) << t.execute.mean
+            << std::setw(10) << t.execute.p50 << std::setw(10) << t.execute.p99
+            << std::setw(12) << t.queued.mean << std::setw(12) << t.submit.mean << std::endl;
+    }
+
+    return out.str();
+}
+
+static std::string jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            out += ' ';
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+static void writePhase(std::ostream& out, const char* name, const PhaseStats& s)
+{
+    out << "\"" << name << "\": {\"count\": " << s.count << ", \"min\": " << s.min << ", \"mean\": " << s.mean
+        << ", \"p50\": " << s.p50 << ", \"p99\": " << s.p99 << "}";
+}
+
+std::string KernelStats::json()
+{
+    std::vector<KernelTimings> timings = summary();
+
+    std::ostringstream out;
+    out << "[";
+    for (size_t i = 0; i < timings.size(); i++)
+    {
+        const KernelTimings &t = timings[i];
+        out << (i > 0 ? ",\n " : "\n ") << "{\"kernel\": " << jsonString(t.kernel) << ", \"variant\": " << jsonString(t.variant) << ", ";
+        writePhase(out, "queued", t.queued);
+        out << ", ";
+        writePhase(out, "submit", t.submit);
+        out << ", ";
+        writePhase(out, "execute", t.execute);
+        out << "}";
+    }
+    out << "\n]" << std::endl;
+
+    return out.str();
+}
+
+} // end namespace clt
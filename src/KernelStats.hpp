@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+namespace clt {
+
+// Summary of one launch phase, in milliseconds
+struct PhaseStats
+{
+    unsigned long long count = 0;
+    double min = 0.0;
+    double mean = 0.0;
+    double p50 = 0.0; // percentiles over the most recent launches
+    double p99 = 0.0;
+};
+
+// Timings of one kernel variant
+struct KernelTimings
+{
+    std::string kernel;  // file:entryPoint
+    std::string variant; // additional build options
+    PhaseStats queued;   // queued -> submit
+    PhaseStats submit;   // submit -> start
+    PhaseStats execute;  // start -> end
+};
+
+// Running launch statistics of one kernel variant.
+// Fed from event callbacks, never blocks the enqueueing thread.
+class LaunchSeries
+{
+public:
+    // Profiling timestamps in ns
+    void add(unsigned long long queued, unsigned long long submit, unsigned long long start, unsigned long long end);
+    void summarize(KernelTimings& timings);
+
+private:
+    static const size_t WINDOW = 1024; // samples kept for percentiles
+
+    struct Phase
+    {
+        unsigned long long count = 0;
+        unsigned long long min = 0;
+        double sum = 0.0;
+        std::vector<unsigned long long> recent; // ring buffer
+    };
+
+    static void addSample(Phase& phase, unsigned long long ns);
+    static void summarize(Phase& phase, PhaseStats& stats);
+
+    Phase m_queued;
+    Phase m_submit;
+    Phase m_execute;
+    std::mutex m_mutex;
+};
+
+// Process-wide registry of kernel launch statistics
+class KernelStats
+{
+public:
+    static KernelStats& get();
+
+    std::shared_ptr<LaunchSeries> series(const std::string& kernel, const std::string& variant);
+    std::vector<KernelTimings> summary();
+    void reset();
+
+    // Launches whose timings are harvested by a pending completion callback
+    void beginLaunch();
+    void endLaunch();
+
+    // Waits until the callbacks of completed launches have run, false on timeout.
+    // Callbacks fire after completion, the queues should be finished first.
+    bool flush(unsigned timeoutMs = 1000);
+
+    std::string table();
+    std::string json();
+
+private:
+    KernelStats(void) {}
+
+    std::map<std::pair<std::string, std::string>, std::shared_ptr<LaunchSeries>> m_series;
+    std::mutex m_mutex;
+
+    size_t m_pending = 0;
+    std::mutex m_pendingMutex;
+    std::condition_variable m_pendingDone;
+};
+
+} // end namespace clt
@@ -0,0 +1,195 @@
+#include "LaunchSequence.hpp"
+#include "Autotuner.hpp"
+#include <algorithm>
+
+namespace clt {
+
+size_t LaunchSequence::add(Kernel& kernel, cl::CommandQueue& queue, const cl::NDRange& global, const cl::NDRange& local,
+    const cl::NDRange& offset, const std::vector<size_t>& dependsOn)
+{
+    const size_t index = m_launches.size();
+    for (size_t dep : dependsOn)
+    {
+        if (dep >= index)
+            throw std::runtime_error("LaunchSequence: launches can only depend on earlier ones");
+        m_launches[dep].needsEvent = true;
+    }
+
+    if (global.dimensions() == 0 || global.dimensions() > 3)
+        throw std::runtime_error("LaunchSequence: invalid global size");
+    if (local.dimensions() != 0 && local.dimensions() != global.dimensions())
+        throw std::runtime_error("LaunchSequence: local size dimensions differ from global size");
+
+    Launch launch;
+    launch.kernel = &kernel;
+    launch.queue = queue;
+    launch.args = kernel.snapshotArgs();
+    launch.vectors = kernel.m_boundVectors;
+    launch.dependsOn = dependsOn;
+    launch.dims = (cl_uint)global.dimensions();
+    launch.global = global;
+    launch.hasLocal = (local.dimensions() != 0);
+    launch.hasOffset = (offset.dimensions() != 0);
+    for (cl_uint d = 0; d < launch.dims; d++)
+    {
+        launch.globalSizes[d] = ((const size_t*)global)[d];
+        launch.localSizes[d] = launch.hasLocal ? ((const size_t*)local)[d] : 0;
+        launch.offsets[d] = (d < offset.dimensions()) ? ((const size_t*)offset)[d] : 0;
+    }
+
+    // Completion of the sequence: the last launch of every queue
+    auto sameQueue = [&](size_t i) { return m_launches[i].queue() == queue(); };
+    auto last = std::find_if(m_lastOnQueue.begin(), m_lastOnQueue.end(), sameQueue);
+    if (last != m_lastOnQueue.end())
+        *last = index;
+    else
+        m_lastOnQueue.push_back(index);
+
+    m_launches.push_back(launch);
+    return index;
+}
+
+void LaunchSequence::setVarying(size_t launch, const std::vector<std::string>& argNames, std::function<void(Kernel&)> update)
+{
+    if (launch >= m_launches.size())
+        throw std::runtime_error("LaunchSequence: invalid launch index");
+
+    // Unset values are skipped by restoreArgs()
+    ArgSnapshot &args = m_launches[launch].args;
+    for (const std::string &name : argNames)
+    {
+        auto it = std::find(args.names.begin(), args.names.end(), name);
+        if (it != args.names.end())
+            args.values[it - args.names.begin()].isSet = false;
+        else if (!m_launches[launch].kernel->hasArg(name))
+            m_launches[launch].kernel->unknownArg(name);
+    }
+
+    m_launches[launch].update = update;
+}
+
+// Kernel of the queue's device and local size, redone after rebuilds
+void LaunchSequence::resolve(Launch& launch)
+{
+    Kernel &kernel = *launch.kernel;
+    cl::Kernel *handle = nullptr;
+    cl::NDRange *tunedLocal = nullptr;
+    kernel.selectKernel(launch.queue, handle, tunedLocal);
+
+    launch.handle = (*handle)();
+    launch.useLocal = launch.hasLocal;
+    if (!launch.hasLocal && localSizeFits(launch.global, *tunedLocal))
+    {
+        const size_t *sizes = *tunedLocal;
+        std::copy(sizes, sizes + launch.dims, launch.localSizes);
+        launch.useLocal = true;
+    }
+
+    launch.buildId = kernel.m_buildId;
+    launch.resolved = true;
+}
+
+cl_int LaunchSequence::replay(const std::vector<cl::Event>* events, cl::Event* event)
+{
+    releaseEvents();
+    m_events.assign(m_launches.size(), nullptr);
+
+    for (size_t i = 0; i < m_launches.size(); i++)
+    {
+        Launch &launch = m_launches[i];
+        Kernel &kernel = *launch.kernel;
+
+        // Background builds are swapped in between replays
+        if (kernel.m_pending)
+            kernel.applyPendingBuild();
+        if (!launch.resolved || launch.buildId != kernel.m_buildId)
+            resolve(launch);
+
+        // Nothing has touched the arguments since this launch last set them
+        cl_int err = CL_SUCCESS;
+        if (!launch.argsApplied || launch.argVersion != kernel.m_argVersion)
+        {
+            err = kernel.restoreArgs(launch.args);
+            if (err != CL_SUCCESS)
+                return err;
+        }
+        if (launch.update)
+            launch.update(kernel);
+        launch.argVersion = kernel.m_argVersion;
+        launch.argsApplied = true;
+        // Vectors of the capture may have been unbound by other launches of the kernel
+        kernel.syncVectors();
+        for (Kernel::BoundVector &bound : launch.vectors)
+        {
+            if (!bound.launched.expired())
+                bound.upload();
+        }
+
+        m_waitList.clear();
+        if (launch.dependsOn.empty() && events)
+        {
+            for (const cl::Event &e : *events)
+                m_waitList.push_back(e());
+        }
+        for (size_t dep : launch.dependsOn)
+            m_waitList.push_back(m_events[dep]);
+
+        const bool isLast = std::find(m_lastOnQueue.begin(), m_lastOnQueue.end(), i) != m_lastOnQueue.end();
+        cl_event *out = (launch.needsEvent || (event && isLast)) ? &m_events[i] : nullptr;
+        err = clEnqueueNDRangeKernel(launch.queue(), launch.handle, launch.dims, launch.hasOffset ? launch.offsets : nullptr,
+            launch.globalSizes, launch.useLocal ? launch.localSizes : nullptr,
+            (cl_uint)m_waitList.size(), m_waitList.empty() ? nullptr : m_waitList.data(), out);
+        if (err != CL_SUCCESS)
+            return cl::detail::errHandler(err, "clEnqueueNDRangeKernel");
+        kernel.markVectorsWritten();
+        for (Kernel::BoundVector &bound : launch.vectors)
+        {
+            std::shared_ptr<bool> launched = bound.launched.lock();
+            if (launched && bound.writable)
+                *launched = true;
+        }
+    }
+
+    if (!event || m_launches.empty())
+        return CL_SUCCESS;
+
+    // One queue: its last launch, otherwise a marker joining the queues
+    cl_event done = nullptr;
+    if (m_lastOnQueue.size() == 1)
+    {
+        done = m_events[m_lastOnQueue[0]];
+        clRetainEvent(done);
+    }
+    else
+    {
+        m_waitList.clear();
+        for (size_t i : m_lastOnQueue)
+            m_waitList.push_back(m_events[i]);
+
+        cl_int err = clEnqueueMarkerWithWaitList(m_launches.back().queue(), (cl_uint)m_waitList.size(), m_waitList.data(), &done);
+        if (err != CL_SUCCESS)
+            return cl::detail::errHandler(err, "clEnqueueMarkerWithWaitList");
+    }
+
+    *event = cl::Event(done);
+    return CL_SUCCESS;
+}
+
+void LaunchSequence::clear()
+{
+    releaseEvents();
+    m_launches.clear();
+    m_lastOnQueue.clear();
+}
+
+void LaunchSequence::releaseEvents()
+{
+    for (cl_event e : m_events)
+    {
+        if (e)
+            clReleaseEvent(e);
+    }
+    m_events.clear();
+}
+
+} // end namespace clt
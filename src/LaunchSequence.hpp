@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "../include/cl_header.hpp"
+#include "Kernel.hpp"
+
+namespace clt {
+
+// Recorded kernel launches, replayed with minimal host work. Each launch keeps the
+// arguments its kernel had when it was added, its ranges and the launches it waits
+// for. Replay resolves nothing by name: arguments are only passed to the driver
+// when another launch or the application changed them in between, and only
+// launches other launches depend on produce events. Rebuilt kernels are picked up
+// at the next replay. DeviceVectors bound to the kernel are synced as by
+// Kernel::enqueue(). Replays are not recorded in the kernel statistics.
+class LaunchSequence
+{
+public:
+    LaunchSequence() = default;
+    ~LaunchSequence() { releaseEvents(); }
+
+    LaunchSequence(const LaunchSequence&) = delete;
+    LaunchSequence& operator=(const LaunchSequence&) = delete;
+
+    // Captures the current arguments of kernel, which must outlive the sequence.
+    // Launches listed in dependsOn must have been added before, launches on the
+    // same in-order queue are ordered without them. Returns the launch index.
+    size_t add(Kernel& kernel, cl::CommandQueue& queue, const cl::NDRange& global, const cl::NDRange& local = cl::NullRange,
+        const cl::NDRange& offset = cl::NullRange, const std::vector<size_t>& dependsOn = {});
+
+    // Arguments set by 'update' before every replay of the launch instead of
+    // restored from the capture, e.g. a frame index or a per-frame buffer
+    void setVarying(size_t launch, const std::vector<std::string>& argNames, std::function<void(Kernel&)> update);
+
+    // Launches without dependencies wait for events. The event completes
+    // when every launch of the sequence has.
+    cl_int replay(const std::vector<cl::Event>* events = nullptr, cl::Event* event = nullptr);
+
+    size_t size() const { return m_launches.size(); }
+    void clear();
+
+private:
+    struct Launch
+    {
+        Kernel *kernel = nullptr;
+        cl::CommandQueue queue;
+        ArgSnapshot args;                  // varying arguments left unset
+        std::vector<Kernel::BoundVector> vectors; // DeviceVectors bound at capture
+        std::function<void(Kernel&)> update;
+        std::vector<size_t> dependsOn;
+        bool needsEvent = false;           // waited for by later launches or the caller
+
+        cl_uint dims = 0;
+        cl::NDRange global;
+        size_t globalSizes[3] = { 0, 0, 0 };
+        size_t localSizes[3] = { 0, 0, 0 };
+        size_t offsets[3] = { 0, 0, 0 };
+        bool hasLocal = false;             // given at add()
+        bool hasOffset = false;
+
+        // Resolved against the kernel build
+        unsigned buildId = 0;
+        bool resolved = false;
+        cl_kernel handle = nullptr;
+        bool useLocal = false;
+        unsigned argVersion = 0;           // of the kernel after the last replay
+        bool argsApplied = false;
+    };
+
+    void resolve(Launch& launch);
+    void releaseEvents();
+
+    std::vector<Launch> m_launches;
+    std::vector<size_t> m_lastOnQueue;
+    std::vector<cl_event> m_events; // of the last replay, by launch
+    std::vector<cl_event> m_waitList;
+};
+
+} // end namespace clt
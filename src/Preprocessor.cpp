@@ -0,0 +1,535 @@
+#include "Preprocessor.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <cctype>
+#include <cstring>
+
+namespace clt {
+
+static const int MAX_INCLUDE_DEPTH = 64;
+
+static bool isIdentChar(char c)
+{
+    return std::isalnum((unsigned char)c) || c == '_';
+}
+
+// Longest punctuator at s, C operators are matched greedily
+static size_t punctuatorLength(const char* s)
+{
+    static const char* three[] = { "<<=", ">>=", "...", nullptr };
+    static const char* two[] = { "++", "--", "->", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+        "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "##", nullptr };
+
+    for (int i = 0; three[i]; i++)
+        if (std::strncmp(s, three[i], 3) == 0)
+            return 3;
+    for (int i = 0; two[i]; i++)
+        if (std::strncmp(s, two[i], 2) == 0)
+            return 2;
+    return 1;
+}
+
+std::vector<SourceToken> tokenizeSource(const std::string& src)
+{
+    std::vector<SourceToken> tokens;
+    const size_t n = src.size();
+    size_t i = 0;
+    int line = 0, physLine = 0;
+    bool lineStart = true;  // no tokens on the logical line yet
+    bool inDirective = false;
+    bool space = true;
+
+    while (i < n)
+    {
+        const char c = src[i];
+
+        // Line continuation
+        if (c == '\\' && (i + 1 < n) && (src[i + 1] == '\n' || (src[i + 1] == '\r' && i + 2 < n && src[i + 2] == '\n')))
+        {
+            i += (src[i + 1] == '\r') ? 3 : 2;
+            physLine++;
+            space = true;
+            continue;
+        }
+
+        if (c == '\n')
+        {
+            i++;
+            line++;
+            physLine++;
+            lineStart = true;
+            inDirective = false;
+            space = true;
+            continue;
+        }
+
+        if (std::isspace((unsigned char)c))
+        {
+            i++;
+            space = true;
+            continue;
+        }
+
+        // Comments act as whitespace
+        if (c == '/' && i + 1 < n && src[i + 1] == '/')
+        {
+            while (i < n && src[i] != '\n')
+                i++;
+            space = true;
+            continue;
+        }
+
+        if (c == '/' && i + 1 < n && src[i + 1] == '*')
+        {
+            size_t end = src.find("*/", i + 2);
+            end = (end == std::string::npos) ? n : end + 2;
+            for (size_t j = i; j < end; j++)
+                if (src[j] == '\n')
+                    physLine++; // a directive continues past comments
+            i = end;
+            space = true;
+            continue;
+        }
+
+        SourceToken tok;
+        tok.offset = i;
+        tok.line = line;
+        tok.physLine = physLine;
+        tok.spaceBefore = space;
+
+        if (lineStart && c == '#')
+            inDirective = true;
+        tok.directive = inDirective;
+
+        size_t len = 1;
+        if (std::isalpha((unsigned char)c) || c == '_')
+        {
+            while (i + len < n && isIdentChar(src[i + len]))
+                len++;
+        }
+        else if (std::isdigit((unsigned char)c) || (c == '.' && i + 1 < n && std::isdigit((unsigned char)src[i + 1])))
+        {
+            // pp-number, exponents may carry a sign
+            while (i + len < n)
+            {
+                const char d = src[i + len];
+                const char prev = src[i + len - 1];
+                if (isIdentChar(d) || d == '.')
+                    len++;
+                else if ((d == '+' || d == '-') && (prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P'))
+                    len++;
+                else
+                    break;
+            }
+        }
+        else if (c == '"' || c == '\'')
+        {
+            while (i + len < n && src[i + len] != c && src[i + len] != '\n')
+                len += (src[i + len] == '\\' && i + len + 1 < n) ? 2 : 1;
+            if (i + len < n && src[i + len] == c)
+                len++;
+        }
+        else
+        {
+            len = punctuatorLength(src.c_str() + i);
+        }
+
+        tok.text = src.substr(i, len);
+        tokens.push_back(tok);
+        i += len;
+        lineStart = false;
+        space = false;
+    }
+
+    return tokens;
+}
+
+// Index one past the last token of the logical line starting at tokens[i]
+static size_t lineEnd(const std::vector<SourceToken>& tokens, size_t i)
+{
+    size_t j = i;
+    while (j < tokens.size() && tokens[j].line == tokens[i].line)
+        j++;
+    return j;
+}
+
+static bool isDirective(const std::vector<SourceToken>& tokens, size_t i, const char* name)
+{
+    return i + 1 < tokens.size() && tokens[i].directive && tokens[i].text == "#" &&
+        tokens[i + 1].line == tokens[i].line && tokens[i + 1].text == name;
+}
+
+// Guarded files start with #ifndef X / #if !defined(X), then #define X,
+// and the matching #endif is the last line
+static bool hasIncludeGuard(const std::vector<SourceToken>& tokens)
+{
+    std::string guard;
+    size_t defineLine = 0;
+    if (isDirective(tokens, 0, "ifndef") && tokens.size() > 2)
+    {
+        guard = tokens[2].text;
+    }
+    else if (isDirective(tokens, 0, "if") && tokens.size() > 4 && tokens[2].text == "!" && tokens[3].text == "defined")
+    {
+        guard = (tokens[4].text == "(" && tokens.size() > 5) ? tokens[5].text : tokens[4].text;
+    }
+    else
+    {
+        return false;
+    }
+
+    defineLine = lineEnd(tokens, 0);
+    if (!isDirective(tokens, defineLine, "define") || defineLine + 2 >= tokens.size() || tokens[defineLine + 2].text != guard)
+        return false;
+
+    // Find the #endif matching the opening conditional
+    int depth = 0;
+    for (size_t i = 0; i < tokens.size(); i = lineEnd(tokens, i))
+    {
+        if (isDirective(tokens, i, "if") || isDirective(tokens, i, "ifdef") || isDirective(tokens, i, "ifndef"))
+            depth++;
+        else if (isDirective(tokens, i, "endif") && --depth == 0)
+            return lineEnd(tokens, i) == tokens.size();
+    }
+
+    return false;
+}
+
+static bool parseInclude(const std::string& src, const std::vector<SourceToken>& tokens, size_t i, IncludeDirective& incl)
+{
+    if (!isDirective(tokens, i, "include") || i + 2 >= tokens.size() || tokens[i + 2].line != tokens[i].line)
+        return false;
+
+    const SourceToken &spec = tokens[i + 2];
+    if (spec.text.size() >= 2 && spec.text[0] == '"' && spec.text.back() == '"')
+    {
+        incl.name = spec.text.substr(1, spec.text.size() - 2);
+        incl.angled = false;
+    }
+    else if (spec.text == "<")
+    {
+        size_t end = src.find('>', spec.offset);
+        size_t eol = src.find('\n', spec.offset);
+        if (end == std::string::npos || end > eol)
+            return false;
+        incl.name = src.substr(spec.offset + 1, end - spec.offset - 1);
+        incl.angled = true;
+    }
+    else
+    {
+        return false; // computed include, left for the compiler
+    }
+
+    incl.firstLine = tokens[i].physLine;
+    incl.lastLine = tokens[lineEnd(tokens, i) - 1].physLine;
+    return !incl.name.empty();
+}
+
+SourceScan scanSource(const std::string& contents)
+{
+    SourceScan scan;
+    const std::vector<SourceToken> tokens = tokenizeSource(contents);
+
+    // Normalized stream: tokens separated by single spaces, directives end in newlines.
+    // Whitespace is only kept where it changes meaning: '(' directly after a macro name.
+    HashStream hash, lines;
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        const SourceToken &tok = tokens[i];
+        lines.update(&tok.physLine, sizeof(tok.physLine));
+        const bool macroParams = (i >= 3 && tok.text == "(" && !tok.spaceBefore && isDirective(tokens, i - 3, "define") &&
+            tokens[i - 1].line == tok.line);
+        if (i > 0 && !macroParams)
+            hash.update(" ", 1);
+        hash.update(tok.text.data(), tok.text.size());
+
+        const bool lastOnLine = (i + 1 == tokens.size() || tokens[i + 1].line != tok.line);
+        if (tok.directive && lastOnLine)
+            hash.update("\n", 1);
+    }
+    scan.tokenHash = hash.digest();
+    lines.update(scan.tokenHash);
+    scan.lineHash = lines.digest();
+
+    // Conditional nesting, the guard's own block does not count
+    scan.includeGuard = hasIncludeGuard(tokens);
+    int depth = scan.includeGuard ? -1 : 0;
+    for (size_t i = 0; i < tokens.size(); i = lineEnd(tokens, i))
+    {
+        IncludeDirective incl;
+        if (isDirective(tokens, i, "if") || isDirective(tokens, i, "ifdef") || isDirective(tokens, i, "ifndef"))
+            depth++;
+        else if (isDirective(tokens, i, "endif"))
+            depth--;
+        else if (parseInclude(contents, tokens, i, incl))
+        {
+            incl.conditional = (depth > 0);
+            scan.includes.push_back(incl);
+        }
+        else if (isDirective(tokens, i, "pragma") && i + 2 < tokens.size() && tokens[i + 2].text == "once")
+            scan.pragmaOnce = true;
+    }
+
+    // Identifiers the file can observe. Pasted tokens and computed
+    // includes can form any name, every definition is observable then.
+    std::set<std::string> identifiers;
+    for (const SourceToken &tok : tokens)
+    {
+        if (std::isalpha((unsigned char)tok.text[0]) || tok.text[0] == '_')
+            identifiers.insert(tok.text);
+        else if (tok.text == "##")
+            scan.observesAll = true;
+    }
+    scan.identifiers.assign(identifiers.begin(), identifiers.end());
+
+    for (size_t i = 0; i < tokens.size(); i = lineEnd(tokens, i))
+    {
+        IncludeDirective incl;
+        if (isDirective(tokens, i, "include") && !parseInclude(contents, tokens, i, incl))
+            scan.observesAll = true;
+    }
+
+    return scan;
+}
+
+// Build option split on whitespace, double quotes group
+struct OptionArg
+{
+    std::string raw;   // as written
+    std::string value; // quotes removed
+};
+
+static std::vector<OptionArg> splitOptions(const std::string& buildOpts)
+{
+    std::vector<OptionArg> args;
+    OptionArg current;
+    bool quoted = false, hasArg = false;
+    for (char c : buildOpts)
+    {
+        if (!quoted && std::isspace((unsigned char)c))
+        {
+            if (hasArg)
+                args.push_back(current);
+            current = OptionArg();
+            hasArg = false;
+            continue;
+        }
+
+        current.raw += c;
+        hasArg = true;
+        if (c == '"')
+            quoted = !quoted;
+        else
+            current.value += c;
+    }
+    if (hasArg)
+        args.push_back(current);
+
+    return args;
+}
+
+std::vector<std::string> includeDirsFromOptions(const std::string& buildOpts)
+{
+    const std::vector<OptionArg> args = splitOptions(buildOpts);
+
+    std::vector<std::string> dirs;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (args[i].value == "-I" && i + 1 < args.size())
+            dirs.push_back(unixifyPath(args[++i].value));
+        else if (args[i].value.compare(0, 2, "-I") == 0 && args[i].value.size() > 2)
+            dirs.push_back(unixifyPath(args[i].value.substr(2)));
+    }
+
+    return dirs;
+}
+
+// Definitions whose value mentions an observable identifier are observable too
+std::string filterDefines(const std::string& buildOpts, const std::set<std::string>& identifiers)
+{
+    const std::vector<OptionArg> args = splitOptions(buildOpts);
+
+    // Definitions as (first arg, number of args, name, value)
+    struct Define { size_t arg, count; std::string name, value; bool keep; };
+    std::vector<Define> defines;
+    std::vector<bool> isDefine(args.size(), false);
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string &v = args[i].value;
+        if (v.compare(0, 2, "-D") != 0)
+            continue;
+
+        Define def = { i, 1, "", "", false };
+        std::string body = v.substr(2);
+        if (body.empty() && i + 1 < args.size())
+        {
+            body = args[i + 1].value;
+            def.count = 2;
+        }
+
+        size_t eq = body.find('=');
+        def.name = body.substr(0, eq);
+        def.value = (eq == std::string::npos) ? "" : body.substr(eq + 1);
+        def.name = def.name.substr(0, def.name.find('(')); // function-like macro
+        for (size_t j = 0; j < def.count; j++)
+            isDefine[i + j] = true;
+
+        defines.push_back(def);
+        i += def.count - 1;
+    }
+
+    std::set<std::string> observable = identifiers;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (Define &def : defines)
+        {
+            if (def.keep || !observable.count(def.name))
+                continue;
+
+            def.keep = true;
+            changed = true;
+            for (const SourceToken &tok : tokenizeSource(def.value))
+                observable.insert(tok.text);
+        }
+    }
+
+    std::vector<bool> keep(args.size(), true);
+    for (const Define &def : defines)
+        for (size_t j = 0; j < def.count; j++)
+            keep[def.arg + j] = def.keep;
+
+    std::string filtered;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (!keep[i])
+            continue;
+        if (!filtered.empty())
+            filtered += ' ';
+        filtered += args[i].raw;
+    }
+
+    return filtered;
+}
+
+static bool fileExists(const std::string& path)
+{
+    long long size, mtime;
+    return getFileStat(path, size, mtime);
+}
+
+std::string resolveInclude(const IncludeDirective& incl, const std::string& dir, const std::vector<std::string>& includeDirs)
+{
+    const std::string name = unixifyPath(incl.name);
+    const bool absolute = (!name.empty() && name[0] == '/') || (name.size() > 1 && name[1] == ':');
+    if (absolute)
+        return fileExists(name) ? name : "";
+
+    if (!incl.angled && fileExists(dir + "/" + name))
+        return dir + "/" + name;
+
+    for (const std::string &d : includeDirs)
+    {
+        if (fileExists(d + "/" + name))
+            return d + "/" + name;
+    }
+
+    return "";
+}
+
+static std::string directoryOf(const std::string& path)
+{
+    size_t idx = path.find_last_of('/');
+    return (idx == std::string::npos) ? "." : path.substr(0, idx);
+}
+
+// Already handled by the expansion, compilers warn about it in the main file
+static bool isPragmaOnce(const std::string& line)
+{
+    const std::vector<SourceToken> tokens = tokenizeSource(line);
+    return tokens.size() == 3 && isDirective(tokens, 0, "pragma") && tokens[2].text == "once";
+}
+
+// Guarded files are expanded every time and left to their guard. Files with
+// #pragma once get a guard of their own instead: an inclusion inside a
+// conditional may be skipped by the compiler, so only unconditional ones
+// make later inclusions redundant.
+static void expandFile(const std::string& path, const std::vector<std::string>& includeDirs,
+    std::set<std::string>& included, bool conditional, int depth, std::string& output)
+{
+    if (depth > MAX_INCLUDE_DEPTH)
+    {
+        std::cout << "Include depth exceeded in " << path << std::endl;
+        throw std::runtime_error("Include depth exceeded in " + path);
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Cannot open file " << path << std::endl;
+        throw std::runtime_error("Cannot open file " + path);
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string contents = buffer.str();
+
+    const SourceScan scan = scanSource(contents);
+    if (scan.pragmaOnce && included.count(path))
+        return;
+    if (scan.pragmaOnce && !conditional)
+        included.insert(path);
+
+    const std::string guard = "CLT_PRAGMA_ONCE_" + std::to_string(computeHash(path.data(), path.size()));
+    if (scan.pragmaOnce)
+        output += "#ifndef " + guard + "\n#define " + guard + "\n";
+
+    const std::string dir = directoryOf(path);
+    output += "#line 1 \"" + path + "\"\n";
+
+    size_t next = 0; // next include directive
+    int lineNum = 0;
+    std::istringstream lines(contents);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (next < scan.includes.size() && scan.includes[next].firstLine == lineNum)
+        {
+            const IncludeDirective &incl = scan.includes[next++];
+            const std::string includePath = resolveInclude(incl, dir, includeDirs);
+            if (!includePath.empty())
+            {
+                // Skip continuation lines of the directive
+                while (lineNum < incl.lastLine && std::getline(lines, line))
+                    lineNum++;
+
+                expandFile(includePath, includeDirs, included, conditional || incl.conditional, depth + 1, output);
+                output += "#line " + std::to_string(lineNum + 2) + " \"" + path + "\"\n";
+                lineNum++;
+                continue;
+            }
+        }
+
+        if (scan.pragmaOnce && line.find("once") != std::string::npos && isPragmaOnce(line))
+            line.clear();
+
+        output += line + "\n";
+        lineNum++;
+    }
+
+    if (scan.pragmaOnce)
+        output += "#endif\n";
+}
+
+std::string expandSource(const std::string& path, const std::vector<std::string>& includeDirs)
+{
+    std::string output;
+    std::set<std::string> included;
+    expandFile(unixifyPath(path), includeDirs, included, false, 0, output);
+    return output;
+}
+
+} // end namespace clt
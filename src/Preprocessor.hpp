@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include "utils.hpp"
+
+namespace clt {
+
+// #include directive as written, resolved against the search paths when expanded
+struct IncludeDirective
+{
+    std::string name;
+    bool angled = false; // <name>: only searched in -I paths
+    int firstLine = 0;   // physical lines of the directive, zero-based
+    int lastLine = 0;
+    bool conditional = false; // inside #if, #ifdef or #ifndef other than the include guard
+};
+
+// Preprocessing token with its position in the source
+struct SourceToken
+{
+    std::string text;
+    size_t offset = 0;
+    int line = 0;           // logical line, continuations joined
+    int physLine = 0;
+    bool directive = false; // part of a preprocessor directive line
+    bool spaceBefore = false;
+};
+
+// Result of scanning one source file
+struct SourceScan
+{
+    std::vector<IncludeDirective> includes; // in order of appearance, outside comments
+    bool pragmaOnce = false;
+    bool includeGuard = false;              // whole file in #ifndef X / #define X ... #endif
+    Hash128 tokenHash;                      // insensitive to comments and whitespace
+    Hash128 lineHash;                       // tokens and their line numbers, for __LINE__
+    std::vector<std::string> identifiers;   // sorted, unique
+    bool observesAll = false;               // token pasting or computed includes
+};
+
+// Splits source into preprocessing tokens, comments are dropped
+std::vector<SourceToken> tokenizeSource(const std::string& contents);
+
+SourceScan scanSource(const std::string& contents);
+
+// Search paths given with -I in build options
+std::vector<std::string> includeDirsFromOptions(const std::string& buildOpts);
+
+// Build options without the -D definitions the identifiers cannot observe.
+// Arguments are separated by single spaces.
+std::string filterDefines(const std::string& buildOpts, const std::set<std::string>& identifiers);
+
+// Path of an included file, empty if it is not found.
+// Quoted includes are searched next to the including file first.
+std::string resolveInclude(const IncludeDirective& incl, const std::string& dir, const std::vector<std::string>& includeDirs);
+
+// Expands includes recursively. #line markers map compiler diagnostics back to
+// the original files. Unresolved includes are left for the compiler, so that
+// includes in disabled #if blocks do not have to exist.
+std::string expandSource(const std::string& path, const std::vector<std::string>& includeDirs);
+
+} // end namespace clt
@@ -0,0 +1,163 @@
+#include "ProgramCache.hpp"
+#include "utils.hpp"
+#include <iostream>
+
+namespace clt {
+
+// Never destroyed: kernels constructed as globals release their uses at exit
+ProgramCache& ProgramCache::get()
+{
+    static ProgramCache* cache = new ProgramCache();
+    return *cache;
+}
+
+ProgramUse::~ProgramUse(void)
+{
+    ProgramCache::get().release(m_key, m_entryId);
+}
+
+void ProgramCache::release(const std::string& key, unsigned long long entryId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Entries may have been cleared and rebuilt since
+    auto it = m_entries.find(key);
+    if (it != m_entries.end() && it->second.id == entryId && it->second.uses > 0)
+        it->second.uses--;
+}
+
+cl::Program ProgramCache::getOrBuild(const std::string& key, std::function<cl::Program()> build, bool pinned)
+{
+    std::promise<cl::Program> promise;
+    std::shared_future<cl::Program> future;
+    bool isBuilder = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+            future = it->second.program;
+        }
+        else
+        {
+            trimLocked();
+            future = promise.get_future().share();
+            m_entries[key].program = future;
+            m_entries[key].pinned = pinned;
+            m_entries[key].id = m_nextId++;
+            isBuilder = true;
+        }
+    }
+
+    if (!isBuilder)
+        return future.get(); // rethrows build errors
+
+    try
+    {
+        cl::Program program = build();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_keys[program()] = key;
+        }
+        promise.set_value(program);
+    }
+    catch (...)
+    {
+        // Failed builds are not cached, the next request tries again
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_entries.erase(key);
+        }
+        promise.set_exception(std::current_exception());
+    }
+
+    return future.get();
+}
+
+cl::Kernel ProgramCache::createKernel(cl::Program& program, const std::string& entryPoint, cl_int* errPtr,
+    std::shared_ptr<ProgramUse>* use)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto key = m_keys.find(program());
+    if (key == m_keys.end())
+        return cl::Kernel(program, entryPoint.c_str(), errPtr);
+
+    Entry &entry = m_entries[key->second];
+    if (use)
+    {
+        *use = std::make_shared<ProgramUse>(key->second, entry.id);
+        entry.uses++;
+        entry.used = true;
+    }
+
+    if (!entry.kernelsCreated)
+    {
+        entry.kernelsCreated = true;
+
+        std::vector<cl::Kernel> kernels;
+        cl_int err = CL_SUCCESS;
+        CLT_CALL(err = program.createKernels(&kernels), err);
+        if (err == CL_SUCCESS)
+        {
+            for (cl::Kernel &k : kernels)
+            {
+                // Copied to drop the terminating null included by some headers
+                std::string name = k.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str();
+                entry.spareKernels[name].push_back(k);
+            }
+        }
+    }
+
+    std::vector<cl::Kernel> &spares = entry.spareKernels[entryPoint];
+    if (spares.empty())
+        return cl::Kernel(program, entryPoint.c_str(), errPtr);
+
+    cl::Kernel kernel = spares.back();
+    spares.pop_back();
+    if (errPtr)
+        *errPtr = CL_SUCCESS;
+
+    return kernel;
+}
+
+void ProgramCache::trim()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    trimLocked();
+}
+
+// Programs whose kernels are all gone. Kernels created outside createKernel() are not seen,
+// programs not yet used are kept so that another build cannot trim them before createKernel().
+void ProgramCache::trimLocked()
+{
+    for (auto it = m_keys.begin(); it != m_keys.end(); )
+    {
+        const Entry &entry = m_entries[it->second];
+        if (!entry.pinned && entry.used && entry.uses == 0)
+        {
+            m_entries.erase(it->second);
+            it = m_keys.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void ProgramCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_keys.clear();
+
+    // Builds in progress keep their entries
+    for (auto it = m_entries.begin(); it != m_entries.end(); )
+    {
+        bool ready = it->second.program.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        it = ready ? m_entries.erase(it) : std::next(it);
+    }
+}
+
+} // end namespace clt
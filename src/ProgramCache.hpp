@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <memory>
+#include "../include/cl_header.hpp"
+
+namespace clt {
+
+// Held with a kernel created from a cached program, the program is not trimmed while any use is alive
+class ProgramUse
+{
+public:
+    ProgramUse(const std::string& key, unsigned long long entryId) : m_key(key), m_entryId(entryId) {}
+    ~ProgramUse(void);
+
+    ProgramUse(const ProgramUse&) = delete;
+    ProgramUse& operator=(const ProgramUse&) = delete;
+
+private:
+    std::string m_key;
+    unsigned long long m_entryId;
+};
+
+// Process-wide cache of built programs. Kernels built from the same sources
+// with the same options for the same device share one cl::Program, so N
+// kernels (or kernel instances) from one file cost a single build or binary load.
+class ProgramCache
+{
+public:
+    static ProgramCache& get();
+
+    // Shared program for key, built with 'build' on first use.
+    // Concurrent requests for the same key wait for the first one.
+    // Pinned programs are kept until clear() even when no kernel uses them.
+    cl::Program getOrBuild(const std::string& key, std::function<cl::Program()> build, bool pinned = false);
+
+    // Kernels of cached programs are created together with clCreateKernelsInProgram,
+    // further instances of an entry point are created individually. The program stays
+    // cached while 'use' is held, it is left empty for programs not from the cache.
+    cl::Kernel createKernel(cl::Program& program, const std::string& entryPoint, cl_int* errPtr,
+        std::shared_ptr<ProgramUse>* use = nullptr);
+
+    // Drops programs without uses
+    void trim();
+    void clear();
+
+private:
+    friend class ProgramUse;
+
+    ProgramCache(void) {}
+    void release(const std::string& key, unsigned long long entryId);
+
+    struct Entry
+    {
+        std::shared_future<cl::Program> program;
+        bool kernelsCreated = false;
+        bool pinned = false;
+        unsigned long long id = 0;
+        size_t uses = 0; // live ProgramUse handles
+        bool used = false;
+        std::map<std::string, std::vector<cl::Kernel>> spareKernels; // unclaimed, by entry point
+    };
+
+    void trimLocked();
+
+    std::map<std::string, Entry> m_entries;
+    std::map<cl_program, std::string> m_keys;
+    unsigned long long m_nextId = 1;
+    std::mutex m_mutex;
+};
+
+} // end namespace clt
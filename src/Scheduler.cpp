@@ -0,0 +1,175 @@
+#include "Scheduler.hpp"
+#include "Kernel.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace clt {
+
+Scheduler::Scheduler(State& state, bool outOfOrder)
+{
+    int err = CL_SUCCESS;
+    if (outOfOrder)
+    {
+        cl_command_queue_properties supported = 0;
+        CLT_CALL(supported = state.device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>(&err), err);
+        m_outOfOrder = (err == CL_SUCCESS && (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+        if (!m_outOfOrder)
+            std::cout << "Out-of-order queues not supported, using separate queues" << std::endl;
+    }
+
+    // Profiling as in State, Kernel::enqueue() records timings
+    const cl_command_queue_properties props = CL_QUEUE_PROFILING_ENABLE | (m_outOfOrder ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0);
+    const size_t numQueues = m_outOfOrder ? 1 : 3;
+    for (size_t i = 0; i < numQueues; i++)
+    {
+        cl::CommandQueue queue;
+        CLT_CALL(queue = cl::CommandQueue(state.context, state.device, props, &err), err);
+        check(err, "Failed to create scheduler queue");
+        m_queues.push_back(queue);
+    }
+}
+
+// Commands of an in-order queue already wait for the earlier ones
+void Scheduler::addDependency(const TaskEvent& task, size_t queue, std::vector<cl::Event>& waitList) const
+{
+    if (!task.event() || (task.queue == queue && !m_outOfOrder))
+        return;
+
+    auto same = [&](const cl::Event& e) { return e() == task.event(); };
+    if (std::find_if(waitList.begin(), waitList.end(), same) == waitList.end())
+        waitList.push_back(task.event);
+}
+
+// Buffers that are only read would collect events without bound
+void Scheduler::pruneCompleted(std::vector<TaskEvent>& reads)
+{
+    if (reads.size() < 16)
+        return;
+
+    auto done = [](const TaskEvent& t)
+    {
+        cl_int status = CL_QUEUED;
+        return clGetEventInfo(t.event(), CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) == CL_SUCCESS && status == CL_COMPLETE;
+    };
+    reads.erase(std::remove_if(reads.begin(), reads.end(), done), reads.end());
+}
+
+cl::Event Scheduler::addTask(TaskType type, const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes, Submit submit)
+{
+    const size_t queue = queueIndex(type);
+
+    std::vector<cl::Event> waitList;
+    for (const cl::Memory &mem : reads)
+    {
+        BufferState &buffer = m_buffers[mem()];
+        if (buffer.written)
+            addDependency(buffer.lastWrite, queue, waitList);
+    }
+    for (const cl::Memory &mem : writes)
+    {
+        BufferState &buffer = m_buffers[mem()];
+        if (buffer.written)
+            addDependency(buffer.lastWrite, queue, waitList);
+        for (const TaskEvent &read : buffer.reads)
+            addDependency(read, queue, waitList);
+    }
+
+    cl::Event event;
+    cl_int err = submit(m_queues[queue], waitList.empty() ? nullptr : &waitList, &event);
+    check(err, "Failed to enqueue scheduled task");
+
+    const TaskEvent task = { event, queue };
+    for (const cl::Memory &mem : reads)
+    {
+        std::vector<TaskEvent> &bufferReads = m_buffers[mem()].reads;
+        pruneCompleted(bufferReads);
+        bufferReads.push_back(task);
+    }
+    for (const cl::Memory &mem : writes)
+    {
+        BufferState &buffer = m_buffers[mem()];
+        buffer.lastWrite = task;
+        buffer.written = true;
+        buffer.reads.clear();
+    }
+
+    return event;
+}
+
+cl::Event Scheduler::upload(cl::Buffer& dst, const void* src, size_t size, size_t offset)
+{
+    return addTask(TaskType::Upload, {}, { dst }, [&](cl::CommandQueue& queue, const std::vector<cl::Event>* events, cl::Event* event)
+    {
+        return queue.enqueueWriteBuffer(dst, CL_FALSE, offset, size, src, events, event);
+    });
+}
+
+cl::Event Scheduler::download(void* dst, cl::Buffer& src, size_t size, size_t offset)
+{
+    return addTask(TaskType::Download, { src }, {}, [&](cl::CommandQueue& queue, const std::vector<cl::Event>* events, cl::Event* event)
+    {
+        return queue.enqueueReadBuffer(src, CL_FALSE, offset, size, dst, events, event);
+    });
+}
+
+cl::Event Scheduler::compute(Kernel& kernel, const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes,
+    const cl::NDRange& global, const cl::NDRange& local)
+{
+    return addTask(TaskType::Compute, reads, writes, [&](cl::CommandQueue& queue, const std::vector<cl::Event>* events, cl::Event* event)
+    {
+        return kernel.enqueue(queue, global, local, cl::NullRange, events, event);
+    });
+}
+
+void Scheduler::stream(const void* input, size_t inputSize, size_t inChunkSize, void* output, size_t outChunkSize,
+    std::function<void(size_t chunk, cl::Buffer& in, cl::Buffer& out)> process, unsigned depth)
+{
+    if (inChunkSize == 0)
+        throw std::runtime_error("Scheduler: chunk size must be positive");
+
+    depth = std::max(depth, 1u);
+    const size_t numChunks = (inputSize + inChunkSize - 1) / inChunkSize;
+    cl::Context context = m_queues[0].getInfo<CL_QUEUE_CONTEXT>();
+
+    // Reuse of a slot waits for the download of its previous chunk, through the tracked accesses
+    int err = CL_SUCCESS;
+    std::vector<cl::Buffer> inputs(std::min<size_t>(depth, numChunks)), outputs(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        CLT_CALL(inputs[i] = cl::Buffer(context, CL_MEM_READ_ONLY, inChunkSize, nullptr, &err), err);
+        check(err, "Failed to create stream buffer");
+        CLT_CALL(outputs[i] = cl::Buffer(context, CL_MEM_WRITE_ONLY, std::max<size_t>(outChunkSize, 1), nullptr, &err), err);
+        check(err, "Failed to create stream buffer");
+    }
+
+    for (size_t chunk = 0; chunk < numChunks; chunk++)
+    {
+        cl::Buffer &in = inputs[chunk % inputs.size()];
+        cl::Buffer &out = outputs[chunk % outputs.size()];
+
+        // Output chunks shrink with the input one
+        const size_t inBytes = std::min(inChunkSize, inputSize - chunk * inChunkSize);
+        const size_t outBytes = (inBytes == inChunkSize) ? outChunkSize : (outChunkSize * inBytes) / inChunkSize;
+
+        upload(in, (const unsigned char*)input + chunk * inChunkSize, inBytes);
+        process(chunk, in, out);
+        if (outBytes > 0)
+            download((unsigned char*)output + chunk * outChunkSize, out, outBytes);
+    }
+
+    finish();
+}
+
+void Scheduler::finish()
+{
+    for (cl::CommandQueue &queue : m_queues)
+    {
+        cl_int err = CL_SUCCESS;
+        CLT_CALL(err = queue.finish(), err);
+        check(err, "Failed to finish scheduler queue");
+    }
+
+    m_buffers.clear();
+}
+
+} // end namespace clt
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <functional>
+#include "../include/cl_header.hpp"
+#include "utils.hpp"
+
+namespace clt {
+
+class Kernel;
+
+enum class TaskType
+{
+    Upload,   // host to device
+    Compute,
+    Download  // device to host
+};
+
+// Enqueues tasks on separate upload, compute and download queues of the state's
+// device so that transfers overlap with kernels. Tasks declare the buffers they
+// read and write, and wait only for earlier tasks they conflict with (reads after
+// writes, writes after reads or writes). Buffers are tracked by handle: sub-buffers
+// and their parent are not known to alias.
+class Scheduler
+{
+public:
+    typedef std::function<cl_int(cl::CommandQueue& queue, const std::vector<cl::Event>* events, cl::Event* event)> Submit;
+
+    // With outOfOrder, one out-of-order queue is used if the device supports it
+    Scheduler(State& state, bool outOfOrder = false);
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // 'submit' enqueues the work on the given queue after events and sets event
+    cl::Event addTask(TaskType type, const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes, Submit submit);
+
+    // Non-blocking, host memory must stay valid until the returned event completes.
+    // Pinned memory (e.g. a mapped HostBuffer) is needed for the copies to overlap.
+    cl::Event upload(cl::Buffer& dst, const void* src, size_t size, size_t offset = 0);
+    cl::Event download(void* dst, cl::Buffer& src, size_t size, size_t offset = 0);
+
+    // Arguments are set before the call, they are captured when enqueued
+    cl::Event compute(Kernel& kernel, const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes,
+        const cl::NDRange& global, const cl::NDRange& local = cl::NullRange);
+
+    // Processes input in chunks: uploads chunk i, calls process(i, in, out), which
+    // should add the compute tasks, and downloads the result. depth (2 or 3) device
+    // buffer pairs rotate so that uploads, kernels and downloads of neighbouring
+    // chunks run concurrently. The last chunks may be shorter. Blocks until done.
+    void stream(const void* input, size_t inputSize, size_t inChunkSize, void* output, size_t outChunkSize,
+        std::function<void(size_t chunk, cl::Buffer& in, cl::Buffer& out)> process, unsigned depth = 3);
+
+    cl::CommandQueue& getQueue(TaskType type) { return m_queues[queueIndex(type)]; }
+
+    // Waits for every task and forgets the buffer history
+    void finish();
+
+private:
+    struct TaskEvent
+    {
+        cl::Event event;
+        size_t queue;
+    };
+
+    // Access history of one buffer
+    struct BufferState
+    {
+        TaskEvent lastWrite;
+        bool written = false;
+        std::vector<TaskEvent> reads; // since the last write
+    };
+
+    size_t queueIndex(TaskType type) const { return m_queues.size() == 1 ? 0 : (size_t)type; }
+    void addDependency(const TaskEvent& task, size_t queue, std::vector<cl::Event>& waitList) const;
+    static void pruneCompleted(std::vector<TaskEvent>& reads);
+
+    std::vector<cl::CommandQueue> m_queues; // by TaskType, or a single out-of-order queue
+    bool m_outOfOrder = false;
+    std::map<cl_mem, BufferState> m_buffers;
+};
+
+} // end namespace clt
@@ -0,0 +1,227 @@
+#include "SourceWatcher.hpp"
+#include "utils.hpp"
+#include <iostream>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace clt {
+
+static std::string parentDir(const std::string& path)
+{
+    size_t idx = path.find_last_of('/');
+    return (idx == std::string::npos) ? "." : path.substr(0, idx);
+}
+
+// Never destroyed: global kernels unwatch themselves after function-local statics are gone
+SourceWatcher& SourceWatcher::get()
+{
+    static SourceWatcher* watcher = new SourceWatcher();
+    return *watcher;
+}
+
+SourceWatcher::SourceWatcher(void)
+{
+#ifdef __linux__
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+        std::cout << "Could not initialize inotify, kernel hot reload disabled" << std::endl;
+#endif
+}
+
+SourceWatcher::~SourceWatcher(void)
+{
+#ifdef __linux__
+    if (m_fd >= 0)
+        close(m_fd);
+#endif
+}
+
+void SourceWatcher::watch(Kernel* kernel, const std::vector<std::string>& files)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::set<std::string> newFiles;
+    for (const std::string &f : files)
+        newFiles.insert(unixifyPath(getAbsolutePath(f)));
+
+    std::vector<std::string> &oldFiles = m_kernelFiles[kernel];
+    std::set<std::string> oldSet(oldFiles.begin(), oldFiles.end());
+
+    for (const std::string &p : newFiles)
+    {
+        if (oldSet.count(p))
+            continue;
+        if (m_fileKernels[p].empty())
+            addFile(p);
+        m_fileKernels[p].insert(kernel);
+    }
+
+    for (const std::string &p : oldSet)
+    {
+        if (newFiles.count(p))
+            continue;
+        m_fileKernels[p].erase(kernel);
+        if (m_fileKernels[p].empty())
+        {
+            removeFile(p);
+            m_fileKernels.erase(p);
+        }
+    }
+
+    oldFiles.assign(newFiles.begin(), newFiles.end());
+    m_dirty.erase(kernel);
+}
+
+void SourceWatcher::unwatch(Kernel* kernel)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_kernelFiles.find(kernel);
+    if (it == m_kernelFiles.end())
+        return;
+
+    for (const std::string &p : it->second)
+    {
+        m_fileKernels[p].erase(kernel);
+        if (m_fileKernels[p].empty())
+        {
+            removeFile(p);
+            m_fileKernels.erase(p);
+        }
+    }
+
+    m_kernelFiles.erase(it);
+    m_dirty.erase(kernel);
+}
+
+bool SourceWatcher::isDirty(Kernel* kernel)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dirty.count(kernel) > 0;
+}
+
+void SourceWatcher::clearDirty(Kernel* kernel)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dirty.erase(kernel);
+}
+
+void SourceWatcher::markChanged(const std::string& path)
+{
+    auto it = m_fileKernels.find(path);
+    if (it == m_fileKernels.end())
+        return;
+
+    for (Kernel* k : it->second)
+        m_dirty.insert(k);
+}
+
+#ifdef __linux__
+
+void SourceWatcher::addFile(const std::string& path)
+{
+    if (m_fd < 0)
+        return;
+
+    const std::string dir = parentDir(path);
+    if (m_dirRefs[dir]++ > 0)
+        return;
+
+    int wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    if (wd < 0)
+    {
+        std::cout << "Could not watch directory " << dir << std::endl;
+        return;
+    }
+
+    m_dirWds[dir] = wd;
+    m_wdDirs[wd] = dir;
+}
+
+void SourceWatcher::removeFile(const std::string& path)
+{
+    if (m_fd < 0)
+        return;
+
+    const std::string dir = parentDir(path);
+    if (--m_dirRefs[dir] > 0)
+        return;
+
+    m_dirRefs.erase(dir);
+    auto it = m_dirWds.find(dir);
+    if (it != m_dirWds.end())
+    {
+        inotify_rm_watch(m_fd, it->second);
+        m_wdDirs.erase(it->second);
+        m_dirWds.erase(it);
+    }
+}
+
+void SourceWatcher::poll()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd < 0)
+        return;
+
+    alignas(inotify_event) char buffer[4096];
+    while (true)
+    {
+        ssize_t len = read(m_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            break; // EAGAIN: no more events
+
+        for (char* ptr = buffer; ptr < buffer + len; )
+        {
+            const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+
+            // Events were dropped, any watched file may have changed
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                for (auto &it : m_kernelFiles)
+                    m_dirty.insert(it.first);
+            }
+
+            auto dir = m_wdDirs.find(ev->wd);
+            if (dir != m_wdDirs.end() && ev->len > 0)
+                markChanged(dir->second + "/" + ev->name);
+
+            ptr += sizeof(inotify_event) + ev->len;
+        }
+    }
+}
+
+#else
+
+void SourceWatcher::addFile(const std::string& path)
+{
+    long long size = -1, mtime = 0;
+    getFileStat(path, size, mtime);
+    m_fileStamps[path] = std::make_pair(size, mtime);
+}
+
+void SourceWatcher::removeFile(const std::string& path)
+{
+    m_fileStamps.erase(path);
+}
+
+void SourceWatcher::poll()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto &it : m_fileStamps)
+    {
+        long long size = -1, mtime = 0;
+        getFileStat(it.first, size, mtime);
+        if (std::make_pair(size, mtime) != it.second)
+        {
+            it.second = std::make_pair(size, mtime);
+            markChanged(it.first);
+        }
+    }
+}
+
+#endif
+
+} // end namespace clt
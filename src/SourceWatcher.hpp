@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+
+namespace clt {
+
+class Kernel;
+
+// Tracks the include graphs of built kernels and marks kernels dirty
+// when one of their source files changes on disk.
+// Uses inotify on Linux, falls back to polling file stats elsewhere.
+class SourceWatcher
+{
+public:
+    static SourceWatcher& get();
+
+    // Replaces the set of files a kernel depends on, clears its dirty flag
+    void watch(Kernel* kernel, const std::vector<std::string>& files);
+    void unwatch(Kernel* kernel);
+
+    // Processes pending change notifications, never blocks
+    void poll();
+
+    bool isDirty(Kernel* kernel);
+    void clearDirty(Kernel* kernel);
+
+private:
+    SourceWatcher(void);
+    ~SourceWatcher(void);
+
+    void addFile(const std::string& path);
+    void removeFile(const std::string& path);
+    void markChanged(const std::string& path);
+
+    std::map<Kernel*, std::vector<std::string>> m_kernelFiles; // absolute paths
+    std::map<std::string, std::set<Kernel*>> m_fileKernels;
+    std::set<Kernel*> m_dirty;
+    std::mutex m_mutex;
+
+#ifdef __linux__
+    // Directories are watched since editors often save by renaming
+    int m_fd = -1;
+    std::map<int, std::string> m_wdDirs;
+    std::map<std::string, int> m_dirWds;
+    std::map<std::string, int> m_dirRefs;
+#else
+    // (size, mtime) at the time the file was added
+    std::map<std::string, std::pair<long long, long long>> m_fileStamps;
+#endif
+};
+
+} // end namespace clt
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace clt {
+
+// Fixed-size worker pool used for building kernels in parallel
+class ThreadPool
+{
+public:
+    // Zero threads: use hardware concurrency
+    explicit ThreadPool(unsigned numThreads = 0);
+    ~ThreadPool(void);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Tasks must not throw
+    void submit(std::function<void()> task);
+
+    // Blocks until all submitted tasks have finished
+    void wait();
+
+    size_t size() const { return m_workers.size(); }
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_taskAvailable;
+    std::condition_variable m_allDone;
+    size_t m_running = 0;
+    bool m_stop = false;
+};
+
+} // end namespace clt
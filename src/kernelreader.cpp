@@ -1,14 +1,17 @@
 #include "kernelreader.hpp"
+#include "IncludeIndex.hpp"
+#include "KernelCache.hpp"
+#include "ProgramCache.hpp"
+#include "Preprocessor.hpp"
 #include "utils.hpp"
 #include <iostream>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
-#include <sys/stat.h>
-#include <errno.h>
-#if defined(_WIN32)
-#include <direct.h>   // _mkdir
-#endif
+#include <memory>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
 
 
 namespace clt {
@@ -30,9 +33,9 @@ void kernelFromSource(const std::string filename, cl::Context &context, cl::Prog
 }
 
 // Perform include expanding
-void kernelFromSourceExpanded(const std::string filename, cl::Context & context, cl::Program & program, int & err)
+void kernelFromSourceExpanded(const std::string filename, cl::Context & context, cl::Program & program, int & err, const std::vector<std::string> &includeDirs)
 {
-    std::string expandedSrc = readKernel(filename);
+    std::string expandedSrc = readKernel(filename, includeDirs);
     CLT_CALL(program = cl::Program(context, expandedSrc, false, &err), err);
 }
 
@@ -68,204 +71,389 @@ void kernelFromBinary(const std::string filename, cl::Context & context, cl::Dev
     }
 }
 
+// Throws so that batch builds can report failures per kernel
 void verify(const char* msg, int err)
 {
     if (err != CL_SUCCESS)
     {
         std::cout << "ERROR: " << msg << std::endl;
-        waitExit();
+        throw std::runtime_error(msg);
     }
 }
-    
-bool createPath(const std::string& inpath)
+
+// Shared between the caller and the driver's build callback
+struct BuildNotify
 {
-    auto makeDirFun = [](const std::string& p)
-    {
-#if defined(_WIN32)
-        return _mkdir(p.c_str());
-#else
-        return mkdir(p.c_str(), 0755);
-#endif
-    };
-    
-    std::string path = unixifyPath(inpath);
-    if(makeDirFun(path) == -1)
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+};
+
+static void CL_CALLBACK onBuildDone(cl_program, void* userData)
+{
+    std::shared_ptr<BuildNotify>* notify = static_cast<std::shared_ptr<BuildNotify>*>(userData);
     {
-        switch(errno)
-        {
-            case ENOENT:
-                if (createPath(path.substr(0, path.find_last_of('/'))))
-                    return (makeDirFun(path) == 0);
-                else
-                    return false;
-            case EEXIST:
-                return true;
-            default:
-                return false;
-        }
+        std::lock_guard<std::mutex> lock((*notify)->mutex);
+        (*notify)->done = true;
     }
-    
-    return true;
+    (*notify)->cv.notify_all();
+    delete notify;
 }
 
-// Create directory if it doesn't exist
-void createDirectory(const std::string dir)
+// Drivers that support pfn_notify may return before compilation has finished,
+// the others invoke the callback before clBuildProgram returns
+cl_int buildProgram(cl::Program &program, const std::vector<cl::Device> &devices, const std::string &buildOpts)
 {
-    if (!createPath(dir))
-        std::cout << "Could not create kernel cache directory " << dir << std::endl;
-}
+    std::shared_ptr<BuildNotify> notify = std::make_shared<BuildNotify>();
+    cl_int err = CL_SUCCESS;
+    CLT_CALL(err = program.build(devices, buildOpts.c_str(), onBuildDone, new std::shared_ptr<BuildNotify>(notify)), err);
 
+    // Callback is not guaranteed to run on failure, its handle is leaked deliberately
+    if (err != CL_SUCCESS)
+        return err;
 
-// Checks kernel cache for match, otherwise loads from source
-cl::Program kernelFromFile(const std::string path, const std::string buildOpts, const std::string cacheDir, cl::Platform & platform, cl::Context & context, cl::Device & device, int & err)
+    {
+        std::unique_lock<std::mutex> lock(notify->mutex);
+        notify->cv.wait(lock, [&]() { return notify->done; });
+    }
+
+    // Asynchronous builds report failure through the build status
+    for (const cl::Device &device : devices)
+    {
+        cl_build_status status = CL_BUILD_ERROR;
+        CLT_CALL(status = program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device, &err), err);
+        if (err != CL_SUCCESS)
+            return err;
+        if (status != CL_BUILD_SUCCESS)
+            return CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    return CL_SUCCESS;
+}
+    
+// Creates program directly from the mapped binary, no intermediate copies
+cl::Program programFromBinary(const BinaryView& view, cl::Context &context, cl::Device &device, int &err)
 {
-    std::string filename = getFileName(path);
+    cl_device_id deviceId = device();
+    const unsigned char* binary = view.data;
+    size_t size = view.size;
+    cl_int status = CL_SUCCESS;
 
-    // Compute hash of kernel source + build configuration
-    std::string kernelSource = readKernel(path);
+    cl_program program = clCreateProgramWithBinary(context(), 1, &deviceId, &size, &binary, &status, &err);
+    err |= status;
 
-    // Separate binaries by (build options X platform name X device name)
-    kernelSource += buildOpts;
-    kernelSource += platform.getInfo<CL_PLATFORM_NAME>();
-    kernelSource += device.getInfo<CL_DEVICE_NAME>();
+    return (err == CL_SUCCESS) ? cl::Program(program) : cl::Program();
+}
 
-    // Check that binary directory exists
-    createDirectory(cacheDir);
+// Prepended to every cached binary
+struct BinaryHeader
+{
+    char magic[8];                  // format version
+    unsigned long long identity[2]; // driver and device that produced the binary
+    unsigned long long size;        // of the binary that follows
+};
 
-    size_t hash = computeHash(kernelSource.data(), kernelSource.size());
-    std::string binaryPath = cacheDir + "/" + filename + "." + std::to_string(hash) + ".bin";
+static const char BINARY_MAGIC[8] = { 'C', 'L', 'T', 'B', 'I', 'N', '0', '1' };
 
-    cl::Program program;
+// Binaries are only valid for the exact driver and device version
+Hash128 driverIdentity(cl::Platform &platform, cl::Device &device)
+{
+    HashStream hash;
+    hash.update(platform.getInfo<CL_PLATFORM_NAME>());
+    hash.update(platform.getInfo<CL_PLATFORM_VERSION>());
+    hash.update(device.getInfo<CL_DEVICE_NAME>());
+    hash.update(device.getInfo<CL_DEVICE_VERSION>());
+    hash.update(device.getInfo<CL_DRIVER_VERSION>());
+    return hash.digest();
+}
 
-    // Try to open cached kernel binary
-    std::ifstream binaryFile(binaryPath, std::ios::binary | std::ios::ate);
-    if (binaryFile)
+// Stale or foreign entries never reach clCreateProgramWithBinary. They are only
+// removed with the entry lock held, another process may be replacing them.
+static bool findBinary(KernelCache &cache, const std::string &key, const Hash128 &identity, BinaryView &view, bool removeStale)
+{
+    if (!cache.find(key, view))
+        return false;
+
+    BinaryHeader header;
+    bool valid = (view.size >= sizeof(header));
+    if (valid)
     {
-        std::cout << "Loading hashed kernel " << binaryPath << std::endl;
+        memcpy(&header, view.data, sizeof(header));
+        valid = (memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0 &&
+            header.identity[0] == identity.lo && header.identity[1] == identity.hi &&
+            header.size == view.size - sizeof(header));
+    }
 
-        std::ifstream::pos_type pos = binaryFile.tellg();
-        std::vector<unsigned char> binary((unsigned int)pos);
-        binaryFile.seekg(0, std::ios::beg);
-        binaryFile.read((char*)(&binary[0]), pos);
+    if (!valid)
+    {
+        view = BinaryView();
+        if (removeStale)
+        {
+            std::cout << "Discarding stale kernel binary " << cache.location(key) << std::endl;
+            cache.remove(key);
+        }
+        return false;
+    }
+
+    view.data += sizeof(header);
+    view.size -= sizeof(header);
+    return true;
+}
+
+static bool storeBinary(KernelCache &cache, const std::string &key, const Hash128 &identity, const void *data, size_t size)
+{
+    BinaryHeader header;
+    memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    header.identity[0] = identity.lo;
+    header.identity[1] = identity.hi;
+    header.size = size;
+
+    std::vector<unsigned char> entry(sizeof(header) + size);
+    memcpy(entry.data(), &header, sizeof(header));
+    memcpy(entry.data() + sizeof(header), data, size);
+    return cache.store(key, entry.data(), entry.size());
+}
+
+static bool storeProgramBinary(KernelCache &cache, const std::string &key, const Hash128 &identity, cl::Program &program)
+{
+    std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    verify("Incorrect number of kernel binaries generated!", sizes.size() != 1);
 
 #ifdef CLT_CL_LEGACY_HEADER
-        cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), pos));
+    std::vector<char*> ptxs = program.getInfo<CL_PROGRAM_BINARIES>();
+    bool stored = storeBinary(cache, key, identity, ptxs[0], sizes[0]);
+    delete[] ptxs[0];
 #else
-        cl::Program::Binaries binaries = { binary }; // push_back?
+    std::vector<std::vector<unsigned char>> ptxs = program.getInfo<CL_PROGRAM_BINARIES>();
+    bool stored = storeBinary(cache, key, identity, ptxs[0].data(), sizes[0]);
 #endif
 
-        std::vector<cl_int> status;
-        std::vector<cl::Device> devices = { device };
-        CLT_CALL(program = cl::Program(context, devices, binaries, &status, &err), err);
+    return stored;
+}
+
+// Shared library source, compiled once per option set and device
+struct LibraryObject
+{
+    std::string path;
+    std::string opts; // definitions the library does not reference removed
+    std::string key;  // of the compiled object in the kernel cache
+};
 
-        // Check program status
-        for (cl_int i : status) err |= i;
-        verify("Failed to create program from binary", err);
+// Only these options are accepted by clLinkProgram
+static std::string linkOptions(const std::string &buildOpts)
+{
+    static const std::vector<std::string> LINK_OPTIONS = { "-cl-denorms-are-zero", "-cl-no-signed-zeros",
+        "-cl-unsafe-math-optimizations", "-cl-finite-math-only", "-cl-fast-relaxed-math" };
 
-        // Build
-        err = program.build(devices, buildOpts.c_str());
-        verify("Failed to build program loaded from binary", err);
+    std::istringstream in(buildOpts);
+    std::string opt, result;
+    while (in >> opt)
+    {
+        if (std::find(LINK_OPTIONS.begin(), LINK_OPTIONS.end(), opt) != LINK_OPTIONS.end())
+            result += (result.empty() ? "" : " ") + opt;
     }
-    else
+
+    return result;
+}
+
+// Compiled but not linked, includes are expanded as in full builds
+static cl::Program compileObject(const std::string &path, const std::string &opts, const std::vector<std::string> &includeDirs, cl::Context &context, cl::Device &device, int &err)
+{
+    cl::Program program;
+    kernelFromSourceExpanded(path, context, program, err, includeDirs);
+    verify("Failed to create program from source", err);
+
+    cl_device_id deviceId = device();
+    err = clCompileProgram(program(), 1, &deviceId, opts.c_str(), 0, nullptr, nullptr, nullptr, nullptr);
+
+    // Check compile log
+    std::string buildLog;
+    CLT_CALL(program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &buildLog), err);
+    if (buildLog.length() > 2)
+        std::cout << "\n[" << getFileName(path) << " compile log]:" << buildLog << std::endl;
+
+    return program;
+}
+
+// Pinned in the program cache, later links reuse the object even when no kernel holds it
+static cl::Program libraryObject(const LibraryObject &lib, const std::vector<std::string> &includeDirs, KernelCache &cache, cl::Context &context, cl::Device &device, const Hash128 &identity)
+{
+    std::ostringstream programKey;
+    programKey << lib.key << "@" << (const void*)context() << "/" << (const void*)device();
+
+    return ProgramCache::get().getOrBuild(programKey.str(), [&]() -> cl::Program
     {
-        std::cout << "Building kernel " << filename << std::endl;
+        int err = CL_SUCCESS;
+        BinaryView binary;
+        bool cached = findBinary(cache, lib.key, identity, binary, false);
 
-        kernelFromSourceExpanded(path, context, program, err);
-        std::vector<cl::Device> devices = { device };
-        CLT_CALL(err = program.build(devices, buildOpts.c_str()), err);
-
-        // Check build log
-        std::string buildLog;
-        CLT_CALL(program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &buildLog), err);
-        if (buildLog.length() > 2)
-            std::cout << "\n[" << filename << " build log]:" << buildLog << std::endl;
-
-        verify("Kernel compilation failed", err);
-        
-        std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
-        verify("Incorrect number of kernel binaries generated!", sizes.size() != 1);
-
-        // Open target file in overwrite-mode
-        std::ofstream stream;
-        stream.open(binaryPath, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
-        if (!stream.good())
+        std::unique_ptr<FileLock> buildLock;
+        if (!cached)
         {
-            std::cout << "Failed to open kernel binary output file" << std::endl;
-            waitExit();
+            buildLock = cache.lockEntry(lib.key);
+            cached = findBinary(cache, lib.key, identity, binary, true);
         }
 
-#ifdef CLT_CL_LEGACY_HEADER
-        std::vector<char*> ptxs = program.getInfo<CL_PROGRAM_BINARIES>();
-        stream.write(ptxs[0], sizes[0]);
-        delete[] ptxs[0];
-#else
-        std::vector<std::vector<unsigned char>> ptxs = program.getInfo<CL_PROGRAM_BINARIES>();
-        stream.write((const char*)ptxs[0].data(), sizes[0]);
-#endif
-
-        // Check write
-        if (!stream.good())
+        // Compiled objects are linked as loaded, without a build
+        if (cached)
         {
-            std::cout << "Failed to write kernel binary" << std::endl;
-            waitExit();
+            std::cout << "Loading compiled library " << cache.location(lib.key) << std::endl;
+            cl::Program program = programFromBinary(binary, context, device, err);
+            verify("Failed to create library from binary", err);
+            return program;
         }
-        
-        stream.close();
-        std::cout << "Created cached kernel " << binaryPath << std::endl;
-    }
 
-    return program;
+        std::cout << "Compiling library " << getFileName(lib.path) << std::endl;
+        cl::Program program = compileObject(lib.path, lib.opts, includeDirs, context, device, err);
+        verify("Library compilation failed", err);
+
+        if (storeProgramBinary(cache, lib.key, identity, program))
+            std::cout << "Created cached library " << cache.location(lib.key) << std::endl;
+
+        return program;
+    }, true);
 }
 
-std::string readKernel(std::string path)
+// Kernel code is compiled on its own and linked against the library objects
+static cl::Program linkWithLibraries(const std::string &path, const std::string &buildOpts, const std::vector<LibraryObject> &libs,
+    const std::vector<std::string> &includeDirs, KernelCache &cache, cl::Context &context, cl::Device &device, const Hash128 &identity, int &err)
 {
-    std::vector<std::string> incl;
-    return readKernel(path, incl);
+    std::vector<cl::Program> objects = { compileObject(path, buildOpts, includeDirs, context, device, err) };
+    verify("Kernel compilation failed", err);
+
+    for (const LibraryObject &lib : libs)
+        objects.push_back(libraryObject(lib, includeDirs, cache, context, device, identity));
+
+    std::vector<cl_program> inputs;
+    for (cl::Program &object : objects)
+        inputs.push_back(object());
+
+    cl_device_id deviceId = device();
+    cl_program linked = clLinkProgram(context(), 1, &deviceId, linkOptions(buildOpts).c_str(), (cl_uint)inputs.size(), inputs.data(), nullptr, nullptr, &err);
+
+    return linked ? cl::Program(linked) : cl::Program();
 }
 
-// Read kernel file, handle includes by recursion
-// Used to enable kernel caching on NVIDIA hardware
-std::string readKernel(std::string path, std::vector<std::string> &incl)
+// Checks kernel cache for match, otherwise loads from source
+cl::Program kernelFromFile(const std::string path, const std::string buildOpts, KernelCache &cache, cl::Platform & platform, cl::Context & context, cl::Device & device, int & err,
+    std::string *cacheKey, const std::vector<std::string> &libraries)
 {
-    path = unixifyPath(path);
-    std::ifstream file(path);
-    if (!file)
+    std::string filename = getFileName(path);
+
+    // Check that binary directory exists
+    createDirectory(cache.directory());
+
+    // Hash of kernel source + includes, unchanged files are not read again
+    const std::vector<std::string> includeDirs = includeDirsFromOptions(buildOpts);
+    SourceSummary source = IncludeIndex::get(cache.directory()).summary(path, includeDirs);
+
+    // Separate binaries by (sources X build options X platform name X device name).
+    // Definitions the sources never reference cannot change the binary.
+    HashStream hash;
+    hash.update(source.hash);
+    hash.update(source.observesAll ? buildOpts : filterDefines(buildOpts, source.identifiers));
+    hash.update(platform.getInfo<CL_PLATFORM_NAME>());
+    hash.update(device.getInfo<CL_DEVICE_NAME>());
+
+    // Each library is compiled with the definitions it references,
+    // kernels that differ only elsewhere link the same object
+    std::vector<LibraryObject> libs;
+    for (const std::string &libPath : libraries)
     {
-        std::cout << "Cannot open file " << path << std::endl;
-        waitExit();
+        SourceSummary libSource = IncludeIndex::get(cache.directory()).summary(libPath, includeDirs);
+        LibraryObject lib;
+        lib.path = libPath;
+        lib.opts = libSource.observesAll ? buildOpts : filterDefines(buildOpts, libSource.identifiers);
+
+        HashStream libHash;
+        libHash.update(libSource.hash);
+        libHash.update(lib.opts);
+        libHash.update(platform.getInfo<CL_PLATFORM_NAME>());
+        libHash.update(device.getInfo<CL_DEVICE_NAME>());
+        lib.key = getFileName(libPath) + "." + libHash.digest().toString() + ".obj";
+
+        hash.update(lib.key);
+        libs.push_back(lib);
     }
 
-    // Don't include same file several times
-    if (std::find(incl.begin(), incl.end(), path) != incl.end())
-        return "";
-    else
-        incl.push_back(path);
+    std::string key = filename + "." + hash.digest().toString();
 
-    size_t idx = path.find_last_of('/');
-    std::string dir = path.substr(0, idx);
+    // Driver updates replace entries instead of adding new ones
+    const Hash128 identity = driverIdentity(platform, device);
+    if (cacheKey)
+        *cacheKey = key;
 
-    std::string output;
-    std::string line;
+    // Programs are shared within the process by all kernels built from the same
+    // sources and options, for the same context and device
+    std::ostringstream programKey;
+    programKey << key << "@" << (const void*)context() << "/" << (const void*)device();
 
-    while (file.good())
+    err = CL_SUCCESS;
+    return ProgramCache::get().getOrBuild(programKey.str(), [&]() -> cl::Program
     {
-        getline(file, line);
+        cl::Program program;
+        std::vector<cl::Device> devices = { device };
+
+        // Try to find cached kernel binary
+        BinaryView binary;
+        bool cached = findBinary(cache, key, identity, binary, false);
 
-        if (line.find("#include") == std::string::npos)
+        // Only one process compiles a variant, the others wait for its binary
+        std::unique_ptr<FileLock> buildLock;
+        if (!cached)
         {
-            output.append(line + "\n");
+            buildLock = cache.lockEntry(key);
+            cached = findBinary(cache, key, identity, binary, true);
+        }
+
+        if (cached)
+        {
+            std::cout << "Loading hashed kernel " << cache.location(key) << std::endl;
+
+            program = programFromBinary(binary, context, device, err);
+            verify("Failed to create program from binary", err);
+
+            // Build
+            err = buildProgram(program, devices, buildOpts);
+            verify("Failed to build program loaded from binary", err);
         }
         else
         {
-            std::string includeFileName = line.substr(10, line.length() - 11);
-            if (endsWith(includeFileName, ".cl") || endsWith(includeFileName, ".h")) {
-                std::string toAppend = readKernel(dir + "/" + includeFileName, incl);
-                output.append(toAppend + "\n");
+            std::cout << "Building kernel " << filename << std::endl;
+
+            if (libs.empty())
+            {
+                kernelFromSourceExpanded(path, context, program, err, includeDirs);
+                err = buildProgram(program, devices, buildOpts);
             }
+            else
+            {
+                program = linkWithLibraries(path, buildOpts, libs, includeDirs, cache, context, device, identity, err);
+            }
+
+            // Check build log
+            std::string buildLog;
+            if (program())
+                CLT_CALL(program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &buildLog), err);
+            if (buildLog.length() > 2)
+                std::cout << "\n[" << filename << " build log]:" << buildLog << std::endl;
+
+            verify("Kernel compilation failed", err);
+
+            // Failing to cache is not fatal, the program is still usable
+            if (storeProgramBinary(cache, key, identity, program))
+                std::cout << "Created cached kernel " << cache.location(key) << std::endl;
         }
-    }
 
-    return output;
+        return program;
+    });
+}
+
+// Read kernel file, handle includes with the preprocessor stage
+// Used to enable kernel caching on NVIDIA hardware
+std::string readKernel(std::string path, const std::vector<std::string> &includeDirs)
+{
+    return expandSource(path, includeDirs);
 }
 
 } // end namespace clt
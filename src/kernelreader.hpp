@@ -6,12 +6,21 @@
 
 namespace clt {
 
+class KernelCache;
+struct BinaryView;
+struct Hash128;
+
 void kernelFromSource(const std::string filename, cl::Context &context, cl::Program &program, int &err);
-void kernelFromSourceExpanded(const std::string filename, cl::Context &context, cl::Program &program, int &err);
+void kernelFromSourceExpanded(const std::string filename, cl::Context &context, cl::Program &program, int &err, const std::vector<std::string> &includeDirs = {});
 void kernelFromBinary(const std::string filename, cl::Context &context, cl::Device &device, cl::Program &program, int &err);
-cl::Program kernelFromFile(const std::string filename, const std::string buildOpts, const std::string cacheDir, cl::Platform &platform, cl::Context &context, cl::Device &device, int &err);
+cl_int buildProgram(cl::Program &program, const std::vector<cl::Device> &devices, const std::string &buildOpts);
+cl::Program programFromBinary(const BinaryView& view, cl::Context &context, cl::Device &device, int &err);
+cl::Program kernelFromFile(const std::string filename, const std::string buildOpts, KernelCache &cache, cl::Platform &platform, cl::Context &context, cl::Device &device, int &err,
+    std::string *cacheKey = nullptr, const std::vector<std::string> &libraries = {});
+
+// Identity of the platform, device and driver versions that binaries are valid for
+Hash128 driverIdentity(cl::Platform &platform, cl::Device &device);
 
-std::string readKernel(std::string path, std::vector<std::string> &incl);
-std::string readKernel(std::string path);
+std::string readKernel(std::string path, const std::vector<std::string> &includeDirs = {});
 
 } // end namespace clt
@@ -5,7 +5,22 @@
 #include <vector>
 #include <string>
 #include <iomanip>
+#include <sys/stat.h>
 #include "Kernel.hpp"
+#include "ProgramCache.hpp"
+#include "KernelStats.hpp"
+#include <errno.h>
+#include <atomic>
+#include <cstdio>
+#include <algorithm>
+#include <new>
+#if defined(_WIN32)
+#include <direct.h>   // _mkdir
+#include <process.h>  // _getpid
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
 #if defined(__APPLE__)
 #include <OpenCL/cl_gl_ext.h>
@@ -103,6 +118,73 @@ size_t computeHash(const void* buffer, size_t length)
     return hash;
 }
 
+std::string Hash128::toString() const
+{
+    char str[33];
+    snprintf(str, sizeof(str), "%016llx%016llx", hi, lo);
+    return str;
+}
+
+bool Hash128::fromString(const std::string& str, Hash128& hash)
+{
+    if (str.size() != 32 || str.find_first_not_of("0123456789abcdef") != std::string::npos)
+        return false;
+
+    hash.hi = std::stoull(str.substr(0, 16), nullptr, 16);
+    hash.lo = std::stoull(str.substr(16), nullptr, 16);
+    return true;
+}
+
+HashStream::HashStream(void)
+{
+    const unsigned long long seeds[2] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL };
+    for (int i = 0; i < 2; i++)
+    {
+        m_lanes[i] = XXH64_createState();
+        if (!m_lanes[i])
+        {
+            if (i > 0)
+                XXH64_freeState((XXH64_state_t*)m_lanes[0]);
+            throw std::bad_alloc();
+        }
+        XXH64_reset((XXH64_state_t*)m_lanes[i], seeds[i]);
+    }
+}
+
+HashStream::~HashStream(void)
+{
+    for (int i = 0; i < 2; i++)
+        XXH64_freeState((XXH64_state_t*)m_lanes[i]);
+}
+
+HashStream& HashStream::update(const void* data, size_t length)
+{
+    for (int i = 0; i < 2; i++)
+        XXH64_update((XXH64_state_t*)m_lanes[i], data, length);
+    return *this;
+}
+
+HashStream& HashStream::update(const std::string& piece)
+{
+    const unsigned long long length = piece.size();
+    update(&length, sizeof(length));
+    return update(piece.data(), piece.size());
+}
+
+HashStream& HashStream::update(const Hash128& hash)
+{
+    const unsigned long long words[2] = { hash.lo, hash.hi };
+    return update(words, sizeof(words));
+}
+
+Hash128 HashStream::digest() const
+{
+    Hash128 hash;
+    hash.lo = XXH64_digest((const XXH64_state_t*)m_lanes[0]);
+    hash.hi = XXH64_digest((const XXH64_state_t*)m_lanes[1]);
+    return hash;
+}
+
 size_t fileHash(const std::string filename)
 {
     std::ifstream f(filename, std::ios::binary | std::ios::ate);
@@ -122,6 +204,131 @@ size_t fileHash(const std::string filename)
     return computeHash((const void*)data.data(), (size_t)pos);
 }
 
+bool getFileStat(const std::string path, long long& size, long long& mtime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0)
+        return false;
+    mtime = (long long)st.st_mtime * 1000000000LL;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#if defined(__APPLE__)
+    mtime = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+#endif
+    size = (long long)st.st_size;
+    return true;
+}
+
+std::vector<std::string> listDirectory(const std::string dir)
+{
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((dir + "/*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE)
+        return names;
+    do
+    {
+        std::string name = data.cFileName;
+        if (name != "." && name != "..")
+            names.push_back(name);
+    } while (FindNextFileA(h, &data));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return names;
+    while (dirent* e = readdir(d))
+    {
+        std::string name = e->d_name;
+        if (name != "." && name != "..")
+            names.push_back(name);
+    }
+    closedir(d);
+#endif
+    return names;
+}
+
+bool createPath(const std::string& inpath)
+{
+    auto makeDirFun = [](const std::string& p)
+    {
+#if defined(_WIN32)
+        return _mkdir(p.c_str());
+#else
+        return mkdir(p.c_str(), 0755);
+#endif
+    };
+    
+    std::string path = unixifyPath(inpath);
+    if(makeDirFun(path) == -1)
+    {
+        switch(errno)
+        {
+            case ENOENT:
+                if (createPath(path.substr(0, path.find_last_of('/'))))
+                    return (makeDirFun(path) == 0 || errno == EEXIST); // may race with other builders
+                else
+                    return false;
+            case EEXIST:
+                return true;
+            default:
+                return false;
+        }
+    }
+    
+    return true;
+}
+
+// Create directory if it doesn't exist
+void createDirectory(const std::string dir)
+{
+    if (!createPath(dir))
+        std::cout << "Could not create kernel cache directory " << dir << std::endl;
+}
+
+std::string tempFilePath(const std::string path)
+{
+    static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+    const int pid = _getpid();
+#else
+    const int pid = (int)getpid();
+#endif
+    return path + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+}
+
+bool replaceFile(const std::string src, const std::string dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(src.c_str(), dst.c_str()) == 0;
+#endif
+}
+
+bool truncateFile(const std::string path, long long size)
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER end;
+    end.QuadPart = size;
+    const bool ok = SetFilePointerEx(h, end, NULL, FILE_BEGIN) && SetEndOfFile(h);
+    CloseHandle(h);
+    return ok;
+#else
+    return truncate(path.c_str(), (off_t)size) == 0;
+#endif
+}
+
 cl::Platform& getPlatformByName(std::vector<cl::Platform> &platforms, std::string name) {
     for (cl::Platform &p : platforms) {
         std::string platformName = p.getInfo<CL_PLATFORM_NAME>();
@@ -195,6 +402,45 @@ void setKernelCacheDir(const std::string path)
     Kernel::setCacheDir(path);
 }
 
+void setKernelCacheFormat(CacheFormat format)
+{
+    Kernel::setCacheFormat(format);
+}
+
+void setKernelCacheLimits(unsigned long long maxBytes, size_t maxEntries)
+{
+    KernelCache::setLimits(maxBytes, maxEntries);
+}
+
+size_t collectKernelCache(unsigned long long maxBytes, size_t maxEntries, long long maxAgeSeconds)
+{
+    return Kernel::getCache().collect(maxBytes, maxEntries, maxAgeSeconds);
+}
+
+// Timings are harvested by completion callbacks that may still be running
+void printKernelStats()
+{
+    if (!KernelStats::get().flush())
+        std::cout << "Some launches have not completed, kernel stats are incomplete" << std::endl;
+    std::cout << KernelStats::get().table();
+}
+
+std::string kernelStatsJson()
+{
+    KernelStats::get().flush();
+    return KernelStats::get().json();
+}
+
+void resetKernelStats()
+{
+    KernelStats::get().reset();
+}
+
+void clearProgramCache()
+{
+    ProgramCache::get().clear();
+}
+
 void setGlobalBuildOptions(const std::string opts)
 {
     Kernel::setBuildOptions(opts);
@@ -210,7 +456,84 @@ bool isCpuDebug()
     return Kernel::isCpuDebug();
 }
 
+void setHotReload(bool v)
+{
+    Kernel::setHotReload(v);
+}
+
+void setKernelVariantCacheSize(size_t n)
+{
+    Kernel::setVariantCacheSize(n);
+}
+
+std::vector<BuildResult> buildAll(State& state, unsigned numThreads)
+{
+    if (state.devices.size() > 1)
+        return Kernel::buildAll(state.context, state.devices, state.platform, numThreads);
+    return Kernel::buildAll(state.context, state.device, state.platform, numThreads);
+}
+
+static State initializeState(const std::string& platformName, const std::vector<std::string>& deviceNames, DevicePartition partition, unsigned count);
+
 State initialize(const std::string& platformName, const std::string& deviceName)
+{
+    return initializeDevices(platformName, { deviceName });
+}
+
+State initializeDevices(const std::string& platformName, const std::vector<std::string>& deviceNames)
+{
+    return initializeState(platformName, deviceNames, DevicePartition::Whole, 0);
+}
+
+State initializePartitioned(const std::string& platformName, const std::string& deviceName, DevicePartition partition, unsigned count)
+{
+    return initializeState(platformName, { deviceName }, partition, count);
+}
+
+// Falls back to the whole device if the driver cannot partition it
+std::vector<cl::Device> partitionDevice(cl::Device& device, DevicePartition partition, unsigned count)
+{
+    std::vector<cl_device_partition_property> props;
+    if (partition == DevicePartition::NumaDomains)
+    {
+        props = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+    }
+    else if (partition == DevicePartition::Equal)
+    {
+        // PARTITION_EQUALLY would create units / (units / count) sub-devices, explicit counts give exactly 'count'
+        const cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        if (count == 0 || units < count)
+        {
+            std::cout << "Cannot split " << units << " compute units into " << count << " sub-devices" << std::endl;
+            return { device };
+        }
+
+        props.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+        for (cl_uint i = 0; i < count; i++)
+            props.push_back((cl_device_partition_property)(units / count + (i < units % count ? 1 : 0)));
+        props.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+        props.push_back(0);
+    }
+    else
+    {
+        return { device };
+    }
+
+    int err = 0;
+    std::vector<cl::Device> subDevices;
+    CLT_CALL(err = device.createSubDevices(props.data(), &subDevices), err);
+    if (err == CL_SUCCESS && partition == DevicePartition::Equal && subDevices.size() != count)
+        err = CL_DEVICE_PARTITION_FAILED;
+    if (err != CL_SUCCESS || subDevices.empty())
+    {
+        std::cout << "Could not partition device: " << getCLErrorString(err) << ", using the whole device" << std::endl;
+        return { device };
+    }
+
+    return subDevices;
+}
+
+static State initializeState(const std::string& platformName, const std::vector<std::string>& deviceNames, DevicePartition partition, unsigned count)
 {
     State state;
     int err = 0;
@@ -234,12 +557,28 @@ State initialize(const std::string& platformName, const std::string& deviceName)
         exit(-1);
     }
 
-    // Select correct device
-    state.device = getDeviceByName(devices, deviceName);
-    std::cout << "DEVICE: " << state.device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    // Select correct devices, without duplicates
+    for (const std::string &name : deviceNames)
+    {
+        cl::Device &d = getDeviceByName(devices, name);
+        bool selected = std::any_of(state.devices.begin(), state.devices.end(), [&](const cl::Device &s) { return s() == d(); });
+        if (!selected)
+            state.devices.push_back(d);
+    }
+
+    if (deviceNames.empty())
+        state.devices = devices;
 
-    // Restrict context to selected device
-    devices = { state.device };
+    // Sub-devices replace the selected device
+    if (partition != DevicePartition::Whole)
+        state.devices = partitionDevice(state.devices[0], partition, count);
+
+    state.device = state.devices[0];
+    for (cl::Device &d : state.devices)
+        std::cout << "DEVICE: " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
+
+    // Restrict context to selected devices
+    devices = state.devices;
 
     // Check if GL-CL sharing is available
     auto extensions = state.device.getInfo<CL_DEVICE_EXTENSIONS>();
@@ -309,9 +648,15 @@ State initialize(const std::string& platformName, const std::string& deviceName)
 
     check(err, "Failed to create context");
 
-    // Create command queue for context
-    CLT_CALL(state.cmdQueue = cl::CommandQueue(state.context, state.device, CL_QUEUE_PROFILING_ENABLE, &err), err);
-    check(err, "Failed to create command queue");
+    // Create command queue per device, the first one is the default queue
+    for (cl::Device &d : state.devices)
+    {
+        cl::CommandQueue queue;
+        CLT_CALL(queue = cl::CommandQueue(state.context, d, CL_QUEUE_PROFILING_ENABLE, &err), err);
+        check(err, "Failed to create command queue");
+        state.queues.push_back(queue);
+    }
+    state.cmdQueue = state.queues[0];
 
     return state;
 }
@@ -4,9 +4,12 @@
 #include <stdlib.h>
 #include <vector>
 #include "../include/cl_header.hpp"
+#include "KernelCache.hpp"
 
 namespace clt {
 
+struct BuildResult;
+
 // Determine target
 #if _WIN64
 #define ENVIRONMENT64
@@ -48,9 +51,28 @@ std::string createTempKernelFile(const std::string source, const std::string ent
 
 void printDevices();
 void setKernelCacheDir(const std::string path);
+void setKernelCacheFormat(CacheFormat format);
+
+// Cache budget enforced after every new binary, zero means unlimited
+void setKernelCacheLimits(unsigned long long maxBytes, size_t maxEntries);
+
+// Removes binaries unused for maxAgeSeconds, then least recently used ones
+// until the budget is met. Returns the number of removed binaries.
+size_t collectKernelCache(unsigned long long maxBytes, size_t maxEntries, long long maxAgeSeconds = 0);
+
+// Launch timings recorded by Kernel::enqueue(). Waits briefly for the timings
+// of completed launches, finish the queues before printing.
+void printKernelStats();
+std::string kernelStatsJson();
+void resetKernelStats();
+
+// Releases the programs shared between kernels, kernels keep theirs alive
+void clearProgramCache();
 void setGlobalBuildOptions(const std::string opts);
 void setCpuDebug(bool v);
 bool isCpuDebug();
+void setHotReload(bool v);
+void setKernelVariantCacheSize(size_t n);
 
 bool endsWith(const std::string s, const std::string end);
 std::string unixifyPath(std::string path);
@@ -58,15 +80,88 @@ std::string unixifyPath(std::string path);
 size_t computeHash(const void* buffer, size_t length);
 size_t fileHash(const std::string filename);
 
+// 128-bit hash made of two independently seeded 64-bit lanes
+struct Hash128
+{
+    unsigned long long lo = 0;
+    unsigned long long hi = 0;
+
+    bool operator==(const Hash128& other) const { return lo == other.lo && hi == other.hi; }
+    bool operator!=(const Hash128& other) const { return !(*this == other); }
+
+    std::string toString() const; // 32 hex digits
+    static bool fromString(const std::string& str, Hash128& hash);
+};
+
+// Hashes a sequence of pieces without concatenating them.
+// The bundled xxHash predates XXH3, lanes are XXH64 streams with different seeds.
+class HashStream
+{
+public:
+    HashStream(void);
+    ~HashStream(void);
+
+    HashStream(const HashStream&) = delete;
+    HashStream& operator=(const HashStream&) = delete;
+
+    HashStream& update(const void* data, size_t length);
+    HashStream& update(const std::string& piece); // length-prefixed, pieces cannot run together
+    HashStream& update(const Hash128& hash);
+    Hash128 digest() const;
+
+private:
+    void* m_lanes[2];
+};
+
+// Size and modification time (ns) of a file, false if it cannot be accessed
+bool getFileStat(const std::string path, long long& size, long long& mtime);
+
+// Names of the entries in a directory
+std::vector<std::string> listDirectory(const std::string dir);
+
+// Creates a directory and its parents
+bool createPath(const std::string& path);
+void createDirectory(const std::string dir);
+
+// Unique temporary path next to a file, for publishing it by renaming
+std::string tempFilePath(const std::string path);
+
+// Renames src to dst, replacing dst if it exists
+bool replaceFile(const std::string src, const std::string dst);
+
+// Cuts a file down to size bytes
+bool truncateFile(const std::string path, long long size);
+
 typedef struct {
     cl::Platform platform;
     cl::Device device;
     cl::Context context;
     cl::CommandQueue cmdQueue;
+    std::vector<cl::Device> devices;       // all devices in the context, device first
+    std::vector<cl::CommandQueue> queues;  // one per device, cmdQueue first
     bool hasGLInterop = false;
 } State;
 
 // Does OpenCL initialization
 State initialize(const std::string& platformName, const std::string& deviceName);
 
+// Context with several devices of one platform, an empty list selects all of them.
+// Contexts cannot span platforms, use one State per platform.
+State initializeDevices(const std::string& platformName, const std::vector<std::string>& deviceNames);
+
+enum class DevicePartition
+{
+    Whole,       // the device as is
+    NumaDomains, // one sub-device per NUMA node (CL_DEVICE_AFFINITY_DOMAIN_NUMA)
+    Equal        // 'count' sub-devices, compute units differ by at most one
+};
+
+// Context of the sub-devices of one device, with a queue per partition in State::queues.
+// Memory is placed on first touch, buffers should be initialized by the partition using them.
+State initializePartitioned(const std::string& platformName, const std::string& deviceName, DevicePartition partition, unsigned count = 0);
+std::vector<cl::Device> partitionDevice(cl::Device& device, DevicePartition partition, unsigned count = 0);
+
+// Builds all constructed kernels in parallel
+std::vector<BuildResult> buildAll(State& state, unsigned numThreads = 0);
+
 }
@@ -0,0 +1,106 @@
+#include "clt.hpp"
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+// Kernel cache maintenance:
+//   clt-cache <cacheDir> [--pack] list
+//   clt-cache <cacheDir> [--pack] gc [--max-bytes N[K|M|G]] [--max-entries N] [--max-age-days D]
+
+static void printUsage()
+{
+    std::cout << "Usage: clt-cache <cacheDir> [--pack] list" << std::endl;
+    std::cout << "       clt-cache <cacheDir> [--pack] gc [--max-bytes N[K|M|G]] [--max-entries N] [--max-age-days D]" << std::endl;
+}
+
+static unsigned long long parseBytes(const std::string& s)
+{
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(s.c_str(), &end, 10);
+    switch (end ? *end : '\0')
+    {
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        case 'G': case 'g': return value << 30;
+        default: return value;
+    }
+}
+
+static void listEntries(const std::map<std::string, clt::CacheEntry>& entries)
+{
+    unsigned long long bytes = 0;
+    for (const auto &it : entries)
+    {
+        bytes += it.second.size;
+        std::time_t lastUse = (std::time_t)it.second.lastUse;
+        char timeStr[32];
+        std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M", std::localtime(&lastUse));
+
+        std::cout << std::left << std::setw(12) << it.second.size
+            << std::setw(20) << timeStr
+            << std::setw(8) << it.second.hits
+            << it.first << std::endl;
+    }
+
+    std::cout << entries.size() << " entries, " << bytes / 1000000 << " MB" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printUsage();
+        return 1;
+    }
+
+    const std::string cacheDir = argv[1];
+    clt::CacheFormat format = clt::CacheFormat::Files;
+    std::string command;
+    unsigned long long maxBytes = 0;
+    size_t maxEntries = 0;
+    long long maxAge = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = (i + 1 < argc);
+
+        if (arg == "--pack")
+            format = clt::CacheFormat::Pack;
+        else if (arg == "--max-bytes" && hasValue)
+            maxBytes = parseBytes(argv[++i]);
+        else if (arg == "--max-entries" && hasValue)
+            maxEntries = (size_t)std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--max-age-days" && hasValue)
+            maxAge = (long long)(std::atof(argv[++i]) * 24 * 3600);
+        else if (command.empty() && (arg == "list" || arg == "gc"))
+            command = arg;
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    clt::KernelCache& cache = clt::KernelCache::get(cacheDir, format);
+
+    if (command == "list")
+    {
+        listEntries(cache.scan()); // read-only, includes binaries missing from the manifest
+    }
+    else if (command == "gc")
+    {
+        size_t removed = cache.collect(maxBytes, maxEntries, maxAge);
+        std::cout << "Removed " << removed << " entries" << std::endl;
+        listEntries(cache.entries());
+    }
+    else
+    {
+        printUsage();
+        return 1;
+    }
+
+    return 0;
+}